@@ -0,0 +1,5 @@
+// force-included when building kernel sources on the host, so the direct map points into a buffer
+#include <stdint.h>
+
+extern uint64_t host_direct_base;
+#define DIRECT_BASE host_direct_base
@@ -0,0 +1,105 @@
+// host benchmark for the boot memory map on synthetic maps with many regions
+// usage: memory [regions]
+
+#include "../src/memory.h"
+#include <paging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// backs the low 1G of "physical" memory, which is where the maps grow into
+uint64_t host_direct_base;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// pages of ram in the map, which allocating doesn't change
+static uint64_t memory_pages(void) {
+	uint64_t pages = 0, i = 0, page_start, page_end;
+	while (memory_pages_next(&i, &page_start, &page_end), i != (uint64_t)-1)
+		pages += page_end - page_start;
+	return pages;
+}
+
+// one large region for the maps to grow into, then 48K of ram every 64K, each with a reserved page
+// 8K in, like a fragmented efi map
+#define LARGE_BASE (64UL << 10)
+#define LARGE_SIZE (256UL << 20)
+#define REGION_STRIDE (64UL << 10)
+#define REGION_SIZE (48UL << 10)
+
+int main(int argc, char **argv) {
+	uint64_t regions = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000;
+	uint64_t regions_max = (PDPT_SIZE - LARGE_BASE - LARGE_SIZE) / REGION_STRIDE;
+	if (regions == 0 || regions > regions_max) {
+		fprintf(stderr, "regions must be between 1 and %lu\n", regions_max);
+		return 1;
+	}
+
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+	void *ram = mmap(NULL, PDPT_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (ram == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	host_direct_base = (uint64_t)ram;
+
+	// fault in the large region up front, so memory_alloc's memset doesn't time page faults
+	memset((char*)ram + LARGE_BASE, 0, LARGE_SIZE);
+
+	// build the map the way paging_init does, one descriptor at a time
+	uint64_t start = now_ns();
+	memory_add(LARGE_BASE, LARGE_SIZE);
+	for (uint64_t i = 0; i < regions; i++) {
+		uint64_t base = LARGE_BASE + LARGE_SIZE + i * REGION_STRIDE;
+		memory_add(base, REGION_SIZE);
+		memory_reserve(base + (8UL << 10), PAGE_SIZE);
+	}
+	uint64_t build = now_ns() - start;
+
+	// boot-time allocations, which each reserve what they find
+	uint64_t allocs = regions;
+	start = now_ns();
+	for (uint64_t i = 0; i < allocs; i++)
+		memory_alloc(0, PDPT_SIZE, PAGE_SIZE, PAGE_SIZE);
+	uint64_t alloc = now_ns() - start;
+
+	// allocations with a gap between them add a reserved region apiece, so the maps grow in the
+	// middle of memory_alloc, after it has picked its range
+	uint64_t pages = memory_pages();
+	start = now_ns();
+	for (uint64_t i = 0; i < allocs; i++) {
+		if (memory_alloc(0, PDPT_SIZE, PAGE_SIZE, 2 * PAGE_SIZE) == VIRT_DIRECT(0)) {
+			fprintf(stderr, "out of memory after %lu gapped allocations\n", i);
+			return 1;
+		}
+	}
+	uint64_t gapped = now_ns() - start;
+
+	if (memory_pages() != pages) {
+		fprintf(stderr, "growing the maps lost memory: %lu pages, was %lu\n", memory_pages(), pages);
+		return 1;
+	}
+
+	// lookups from scattered starting points, which can't use the cursor
+	uint64_t finds = regions, found = 0;
+	srand(1);
+	start = now_ns();
+	for (uint64_t i = 0; i < finds; i++) {
+		uint64_t from = LARGE_BASE + LARGE_SIZE + (uint64_t)rand() % regions * REGION_STRIDE;
+		found += memory_find(from, PDPT_SIZE, 2 * PAGE_SIZE, PAGE_SIZE) != 0;
+	}
+	uint64_t find = now_ns() - start;
+
+	printf(
+		"%lu regions: build %lu ns/region, alloc %lu ns/op, gapped alloc %lu ns/op, "
+		"find %lu ns/op (%lu found)\n",
+		regions, build / regions, alloc / allocs, gapped / allocs, find / finds, found
+	);
+	return 0;
+}
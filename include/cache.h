@@ -1,14 +1,108 @@
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#define CACHE_LINE_SIZE 64
+
+enum cache_flags {
+	// align objects to the cache line, or to a fraction of it for small objects
+	cache_flag_hwcache_align = 1 << 0,
+};
 
 void cache_init(void);
 
-struct cache *cache_create(uint32_t object_size);
+// a snapshot of one cache, with objects sitting in magazines counted as active but also as cached
+struct cache_stats {
+	const char *name;
+
+	// callers sharing the cache after merging
+	uint32_t users;
+
+	uint32_t object_size;
+	uint32_t slab_capacity;
+	uint32_t slab_pages;
+
+	uint64_t active;
+	uint64_t total;
+	uint64_t cached;
+
+	uint64_t slabs_full;
+	uint64_t slabs_partial;
+	uint64_t slabs_empty;
+	uint64_t pages;
+
+	// counted since boot- the bootstrap caches don't count these
+	uint64_t alloc;
+	uint64_t free;
+	uint64_t fail;
+};
+
+struct cache *cache_create(const char *name, uint32_t object_size);
+
+// ctor runs once per object when its slab is created, and objects should be returned to the cache
+// in their constructed state- caches without one may be merged with compatible caches
+struct cache *cache_create_ex(
+	const char *name, uint32_t object_size, uint32_t align, uint32_t flags, void (*ctor)(void *object)
+);
+
 void cache_shrink(struct cache *cache);
 void cache_destroy(struct cache *cache);
 
 void *cache_alloc(struct cache *cache);
 void cache_free(struct cache *cache, void *object);
 
-void *kmalloc(size_t size);
+// all or nothing- on failure no objects are allocated
+bool cache_alloc_bulk(struct cache *cache, uint32_t count, void **objects);
+void cache_free_bulk(struct cache *cache, uint32_t count, void **objects);
+
+void cache_stats(struct cache *cache, struct cache_stats *out);
+void cache_stats_dump(void);
+
+// kmalloc size classes are powers of two from 2^KMALLOC_SHIFT_MIN to 2^KMALLOC_SHIFT_MAX,
+// plus 96 and 192 at indices 1 and 2
+#define KMALLOC_SHIFT_MIN 3
+#define KMALLOC_SHIFT_MAX 15
+#define KMALLOC_MAX_SIZE (1UL << KMALLOC_SHIFT_MAX)
+
+// sizes up to this are looked up in a table rather than by log2
+#define KMALLOC_SMALL_MAX 192
+
+extern struct cache *kmalloc_caches[KMALLOC_SHIFT_MAX + 1];
+
+// the size class serving size, which folds to a constant for constant sizes
+static inline unsigned int kmalloc_index(size_t size) {
+	if (size <= 8) return 3;
+	if (size <= 16) return 4;
+	if (size <= 32) return 5;
+	if (size <= 64) return 6;
+	if (size <= 96) return 1;
+	if (size <= 128) return 7;
+	if (size <= 192) return 2;
+	if (size <= 256) return 8;
+	if (size <= 512) return 9;
+	if (size <= 1024) return 10;
+	if (size <= 2048) return 11;
+	if (size <= 4096) return 12;
+	if (size <= 8192) return 13;
+	if (size <= 16384) return 14;
+	return 15;
+}
+
+static inline uint32_t kmalloc_size(unsigned int index) {
+	if (index == 1)
+		return 96;
+	if (index == 2)
+		return 192;
+	return 1U << index;
+}
+
+void *kmalloc_variable(size_t size);
 void kfree(void *ptr);
+
+// constant sizes pick their cache at compile time
+static inline void *kmalloc(size_t size) {
+	if (__builtin_constant_p(size) && size <= KMALLOC_MAX_SIZE)
+		return cache_alloc(kmalloc_caches[kmalloc_index(size)]);
+
+	return kmalloc_variable(size);
+}
@@ -1,7 +1,12 @@
-#define DIRECT_BASE 0xffff800000000000 
+#ifndef DIRECT_BASE
+#define DIRECT_BASE 0xffff800000000000
+#endif
 #define VIRT_DIRECT(phys) ((void*)(DIRECT_BASE + (phys)))
 #define PHYS_DIRECT(virt) ((uint64_t)(virt) - DIRECT_BASE)
 
+// struct page array, backed only for sections of physical memory that exist
+#define MEMMAP_BASE 0xffffea0000000000
+
 #define KERNEL_BASE 0xffffffff80000000
 #define VIRT_KERNEL(phys) ((void*)(KERNEL_BASE + (phys)))
 #define PHYS_KERNEL(phys) ((uint64_t)(phys) - KERNEL_BASE)
@@ -31,14 +36,29 @@
 #define PAGE_PRESENT (1 << 0)
 #define PAGE_WRITE (1 << 1)
 #define PAGE_USER (1 << 2)
-#define PAGE_CACHE_WT (1 << 3)
-#define PAGE_CACHE_UC (1 << 4)
+#define PAGE_PWT (1 << 3)
+#define PAGE_PCD (1 << 4)
 #define PAGE_ACCESSED (1 << 5)
 #define PAGE_DIRTY (1 << 6)
 #define PAGE_LARGE (1 << 7)
+#define PAGE_PAT (1 << 7)
 #define PAGE_GLOBAL (1 << 8)
+#define PAGE_PAT_LARGE (1 << 12)
 #define PAGE_NX (1 << 63)
 
+// bits 12 to 51 of an entry hold the physical address
+#define PAGE_ADDRESS_MASK 0x000ffffffffff000
+
+// memory types, as indices into the pat spread over the pwt, pcd and pat bits (see paging_init_pat)
+// these are in the form of 4k pages- paging_map moves the pat bit for large pages
+// the low half of the pat keeps its power-on values, so wb, wt and uc- don't depend on it
+#define PAGE_CACHE_WB 0
+#define PAGE_CACHE_WT PAGE_PWT
+#define PAGE_CACHE_UC_MINUS PAGE_PCD
+#define PAGE_CACHE_UC (PAGE_PCD | PAGE_PWT)
+#define PAGE_CACHE_WC PAGE_PAT
+#define PAGE_CACHE_MASK (PAGE_PAT | PAGE_PCD | PAGE_PWT)
+
 #ifndef __ASSEMBLY__
 
 #define round_up(x, y) ((((x) - 1) | ((__typeof__(x))((y) - 1))) + 1)
@@ -48,6 +68,14 @@
 #include <stddef.h>
 
 void paging_init(void *map_address, size_t map_size, size_t desc_size);
+void paging_map(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+void paging_unmap(uint64_t virt, uint64_t size);
+void paging_unmap_lazy(uint64_t virt, uint64_t size);
+void paging_flush_all(void);
+void paging_flush_range(uint64_t virt, uint64_t size);
+uint64_t paging_translate(uint64_t virt);
+void paging_set_cache(uint64_t virt, uint64_t size, uint64_t cache);
+void paging_init_pat(void);
 
 static inline void write_cr3(uint64_t cr3) {
 	__asm__ volatile ("mov %0, %%cr3" :: "r"(cr3));
@@ -3,6 +3,7 @@
 #include "../hpet.h"
 #include "../smp.h"
 #include "../pci.h"
+#include "../numa.h"
 #include <kprintf.h>
 #include <assert.h>
 #include <stdbool.h>
@@ -85,6 +86,55 @@ static void mcfg_parse(ACPI_TABLE_MCFG *Mcfg) {
 	}
 }
 
+static void srat_parse(ACPI_TABLE_SRAT *Srat) {
+	for (
+		ACPI_SUBTABLE_HEADER *Affinity = (ACPI_SUBTABLE_HEADER*)(Srat + 1);
+		(char*)Affinity < (char*)Srat + Srat->Header.Length;
+		Affinity = (ACPI_SUBTABLE_HEADER*)((char*)Affinity + Affinity->Length)
+	) {
+		switch (Affinity->Type) {
+		case ACPI_SRAT_TYPE_CPU_AFFINITY: {
+			ACPI_SRAT_CPU_AFFINITY *p = (ACPI_SRAT_CPU_AFFINITY*)Affinity;
+			if (!(p->Flags & ACPI_SRAT_CPU_USE_AFFINITY))
+				break;
+
+			uint32_t domain = p->ProximityDomainLo |
+				p->ProximityDomainHi[0] << 8 |
+				p->ProximityDomainHi[1] << 16 |
+				(uint32_t)p->ProximityDomainHi[2] << 24;
+			numa_add_cpu(domain, p->ApicId);
+			break;
+		}
+
+		case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY: {
+			ACPI_SRAT_X2APIC_CPU_AFFINITY *p = (ACPI_SRAT_X2APIC_CPU_AFFINITY*)Affinity;
+			if (!(p->Flags & ACPI_SRAT_CPU_ENABLED))
+				break;
+
+			numa_add_cpu(p->ProximityDomain, p->ApicId);
+			break;
+		}
+
+		case ACPI_SRAT_TYPE_MEMORY_AFFINITY: {
+			ACPI_SRAT_MEM_AFFINITY *p = (ACPI_SRAT_MEM_AFFINITY*)Affinity;
+			if (!(p->Flags & ACPI_SRAT_MEM_ENABLED) || p->Length == 0)
+				break;
+
+			numa_add_memory(p->ProximityDomain, p->BaseAddress, p->Length);
+			break;
+		}
+		}
+	}
+}
+
+static void slit_parse(ACPI_TABLE_SLIT *Slit) {
+	uint64_t count = Slit->LocalityCount;
+	for (uint64_t from = 0; from < count; from++) {
+		for (uint64_t to = 0; to < count; to++)
+			numa_set_distance(from, to, Slit->Entry[from * count + to]);
+	}
+}
+
 #define ACPI_TABLE_COUNT 128
 static ACPI_TABLE_DESC acpi_tables[ACPI_TABLE_COUNT];
 
@@ -117,4 +167,17 @@ void acpi_parse(ACPI_TABLE_RSDP *Rsdp) {
 		panic("no mcfg available");
 	}
 	mcfg_parse(Mcfg);
+
+	// numa topology is optional, and needs lapic_by_cpu from the madt
+	ACPI_TABLE_SRAT *Srat = NULL;
+	AcpiGetTable(ACPI_SIG_SRAT, 0, (ACPI_TABLE_HEADER**)&Srat);
+	if (Srat != NULL) {
+		srat_parse(Srat);
+
+		ACPI_TABLE_SLIT *Slit = NULL;
+		AcpiGetTable(ACPI_SIG_SLIT, 0, (ACPI_TABLE_HEADER**)&Slit);
+		if (Slit != NULL)
+			slit_parse(Slit);
+	}
+	numa_init();
 }
@@ -1,9 +1,12 @@
 #include "apic.h"
 #include "tsc.h"
 #include "cpu.h"
+#include "vmap.h"
 #include "hpet.h"
+#include "interrupt.h"
 #include <paging.h>
 #include <kprintf.h>
+#include <assert.h>
 
 enum apic_spurious_flags {
 	apic_sw_enable = 1 << 8,
@@ -67,6 +70,17 @@ uint32_t lapic_count;
 static volatile uint32_t *lapic;
 static uint32_t lapic_frequency;
 
+// ia32_apic_base flags for the mode the bsp chose, which every cpu has to match
+static uint32_t apic_msr_flags;
+
+static void apic_enable(void) {
+	uint32_t eax, edx;
+	rdmsr(ia32_apic_base, &eax, &edx);
+	wrmsr(ia32_apic_base, eax | apic_msr_flags, 0);
+
+	apic_write(apic_spurious, apic_sw_enable | interrupt_spurious);
+}
+
 void apic_init(uint32_t lapic_address, bool legacy_pic) {
 	if (legacy_pic)
 		pic_disable();
@@ -75,30 +89,28 @@ void apic_init(uint32_t lapic_address, bool legacy_pic) {
 	cpuid(0x01, &eax, &ebx, &ecx, &edx);
 	bool has_x2apic = ecx & cpuid_01_ecx_x2apic;
 
-	uint32_t msr_flags = apic_global_enable;
+	apic_msr_flags = apic_global_enable;
 	if (has_x2apic) {
 		extern struct apic apic_x2apic;
 		apic = &apic_x2apic;
 
-		msr_flags |= apic_x2apic_enable;
+		apic_msr_flags |= apic_x2apic_enable;
 	} else {
 		extern struct apic apic_flat;
 		apic = &apic_flat;
 
-		// TODO: factor out temporary mappings
-		extern uint64_t kernel_pml4[], pt_map[];
-		pt_map[0] = lapic_address | PAGE_PRESENT | PAGE_WRITE | PAGE_CACHE_UC | PAGE_GLOBAL;
-		write_cr3(PHYS_KERNEL(kernel_pml4));
-		lapic = (uint32_t*)0xffffffffc0000000;
+		lapic = ioremap(lapic_address, PAGE_SIZE);
+		assert(lapic != NULL);
 	}
 
 	kprintf("apic: %s routing\n", apic->name);
 
-	rdmsr(ia32_apic_base, &eax, &edx);
-	wrmsr(ia32_apic_base, eax | msr_flags, 0);
+	apic_enable();
+}
 
-	// TODO: set spurious interrupt vector explicitly
-	apic_write(apic_spurious, apic_read(apic_spurious) | apic_sw_enable);
+// an ap's local apic comes out of init in xapic mode and software disabled
+void apic_init_ap(void) {
+	apic_enable();
 }
 
 void apic_timer_calibrate(void) {
@@ -120,6 +132,20 @@ void apic_timer_calibrate(void) {
 	kprintf("apic timer: %u.%06uMHz\n", lapic_frequency / 1000000, lapic_frequency % 1000000);
 }
 
+// the tick only brings the cpu out of hlt, so its idle loop can poll
+extern void isr_apic_timer_tick(void);
+void apic_timer_tick(struct registers *registers) {
+	apic_write(apic_eoi, 0);
+}
+
+// tick hz times a second on the current cpu
+void apic_timer_start(uint32_t hz) {
+	interrupt_set(interrupt_apic_timer, isr_apic_timer_tick);
+
+	apic_write(apic_lvt_timer, apic_timer_periodic | interrupt_apic_timer);
+	apic_write(apic_timer_init, lapic_frequency / hz);
+}
+
 // x2apic
 
 static uint32_t x2apic_read(uint32_t reg) {
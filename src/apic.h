@@ -2,7 +2,9 @@
 #include <stdbool.h>
 
 void apic_init(uint32_t lapic_address, bool legacy_pic);
+void apic_init_ap(void);
 void apic_timer_calibrate(void);
+void apic_timer_start(uint32_t hz);
 
 enum apic_register {
 	apic_id = 0x02,
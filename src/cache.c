@@ -1,190 +1,1011 @@
 #include "page.h"
 #include "list.h"
+#include "spinlock.h"
+#include "smp.h"
+#include "apic.h"
+#include "numa.h"
 #include <cache.h>
 #include <paging.h>
+#include <kprintf.h>
 #include <assert.h>
 #include <stddef.h>
 #include <stdalign.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
-// TODO: larger slabs
-// TODO: off-slab headers
-// TODO: cache line alignment and coloring
-// TODO: per-cpu object caches
+// slabs are blocks of up to 2^SLAB_MAX_ORDER pages
+#define SLAB_MAX_ORDER 3
+
+// objects at least this big keep their slab header and freelist off the slab
+#define SLAB_OFF_SLAB_SIZE (PAGE_SIZE / 8)
+#define SLAB_OFF_SLAB_CAPACITY ((PAGE_SIZE << SLAB_MAX_ORDER) / SLAB_OFF_SLAB_SIZE)
+
+// objects per magazine- sized so a magazine is two cache lines
+#define MAGAZINE_SIZE 13
+
+// a stack of free objects, owned by one cpu or sitting in a cache's depot
+struct magazine {
+	struct list list;
+	uint32_t rounds;
+	void *objects[MAGAZINE_SIZE];
+};
+
+// per-cpu magazines- previous is always either full or empty
+// aligned so cpus don't share lines
+struct cache_cpu {
+	alignas(CACHE_LINE_SIZE) struct magazine *loaded;
+	struct magazine *previous;
+
+	// counted by each cpu without locking, and summed by cache_stats
+	uint64_t alloc;
+	uint64_t free;
+	uint64_t fail;
+};
+
+// slabs whose pages came from one node
+struct cache_node {
+	alignas(CACHE_LINE_SIZE) struct spinlock lock;
 
-struct cache {
 	struct list partial;
 	struct list empty;
 	struct list full;
 
+	// slabs with objects freed from other nodes, pushed without the lock
+	struct slab *remote_slabs;
+};
+
+struct cache {
+	struct list link;
+	const char *name;
+
+	// full and empty magazines exchanged with cpus
+	struct spinlock depot_lock;
+	struct list depot_full;
+	struct list depot_empty;
+
+	// lapic_count entries, or NULL to bypass the magazine layer
+	struct cache_cpu *cpu;
+
+	struct cache_node nodes[NUMA_MAX_NODES];
+
+	// callers sharing this cache, or 0 for the bootstrap caches
+	uint32_t refcount;
+
+	// run on each object as its slab is created
+	void (*ctor)(void *object);
+
 	uint32_t object_size;
+	uint32_t align;
+	uint32_t flags;
+
+	// where a free object's remote free link goes- past the object itself if it has a constructor
+	uint32_t link_offset;
+
+	uint32_t slab_order;
 	uint32_t slab_capacity;
+	bool off_slab;
+
+	// bytes per freelist entry- just enough to hold slab_capacity
+	uint32_t freelist_entry;
+
+	// objects start at offset + color * color_step, with the color rotating per slab
+	uint32_t offset;
+	uint32_t color_step;
+	uint32_t colors;
+	uint32_t color_next;
+
+	// spread slabs across cache colors
+	uint32_t page_color;
 };
 
 struct slab {
 	struct list list;
 
+	struct page *page;
 	void *objects;
 
+	// objects freed from other nodes, linked through each object's link_offset
+	void *remote_free;
+	struct slab *remote_next;
+
 	uint32_t ref_count;
 	uint32_t next_free;
-	uint32_t free[];
+
+	// the next free object after each free object, in entries of the cache's freelist_entry bytes
+	unsigned char free[];
 };
 
-static struct cache caches = {
-	.full = LIST_INIT(caches.full),
-	.partial = LIST_INIT(caches.partial),
-	.empty = LIST_INIT(caches.empty),
+// the cache of caches
+static struct cache caches;
+
+// magazines for every other cache
+static struct cache magazines;
+
+// headers for off-slab slabs
+static struct cache slab_headers;
+
+// indexed by kmalloc_index- anything bigger than KMALLOC_MAX_SIZE goes straight to the page allocator
+struct cache *kmalloc_caches[KMALLOC_SHIFT_MAX + 1];
+
+static const char *kmalloc_names[KMALLOC_SHIFT_MAX + 1] = {
+	NULL, "kmalloc-96", "kmalloc-192",
+	"kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+	"kmalloc-512", "kmalloc-1k", "kmalloc-2k", "kmalloc-4k", "kmalloc-8k", "kmalloc-16k",
+	"kmalloc-32k",
+};
 
-	.object_size = sizeof(struct cache),
+// kmalloc_index for small sizes, indexed by (size + 7) >> 3
+static const uint8_t size_index[KMALLOC_SMALL_MAX / 8 + 1] = {
+	3, 3,
+	4,
+	5, 5,
+	6, 6, 6, 6,
+	1, 1, 1, 1,
+	7, 7, 7, 7,
+	2, 2, 2, 2, 2, 2, 2, 2,
 };
 
-// TODO: go bigger once we have bigger slab sizes
-static struct {
-	size_t size;
-	struct cache *cache;
-} sized_caches[] = {
-	{ 8, NULL },
-	{ 16, NULL },
-	{ 32, NULL },
-	{ 64, NULL },
-	{ 96, NULL },
-	{ 128, NULL },
-	{ 192, NULL },
-	{ 256, NULL },
-	{ 512, NULL },
-	{ 1024, NULL },
-	{ 2048, NULL },
-	{ 0, NULL },
+// every cache, walked by the shrinker
+static struct spinlock cache_list_lock;
+static struct list cache_list = LIST_INIT(cache_list);
+
+static uint64_t cache_reap(struct cache *cache, uint64_t count);
+
+// give back empty slabs when the page allocator runs dry
+static uint64_t cache_list_shrink(struct shrinker *shrinker, uint64_t count) {
+	uint64_t freed = 0;
+
+	struct spinlock_node node;
+	spin_lock(&cache_list_lock, &node);
+
+	struct list *entry = cache_list.next;
+	for (; entry != &cache_list && freed < count; entry = entry->next)
+		freed += cache_reap(containerof(entry, struct cache, link), count - freed);
+
+	spin_unlock(&cache_list_lock, &node);
+	return freed;
+}
+
+static struct shrinker cache_shrinker = {
+	.priority = 1,
+	.shrink = cache_list_shrink,
 };
 
-static uint32_t calc_slab_capacity(uint32_t object_size) {
+// how many objects fit in a slab, with the objects aligned after the header if there is one,
+// and the narrowest freelist entry that can index them all
+static uint32_t calc_slab_capacity(
+	uint32_t object_size, uint32_t align, uint32_t order, bool off_slab, uint32_t *out_entry
+) {
+	uint32_t slab_size = PAGE_SIZE << order;
 	uint32_t header = sizeof(struct slab);
-	uint32_t entry = sizeof(uint32_t);
 
-	uint32_t i = 0;
-	while (round_up(header + i * entry, object_size) + i * object_size < PAGE_SIZE)
-		i++;
+	uint32_t entry = sizeof(uint8_t);
+	uint32_t i;
+	for (;;) {
+		i = 0;
+		if (off_slab) {
+			i = slab_size / object_size;
+		} else {
+			while (round_up(header + (i + 1) * entry, align) + (i + 1) * object_size <= slab_size)
+				i++;
+		}
+
+		// the capacity itself marks the end of the chain, so it has to fit as well
+		if (entry == sizeof(uint32_t) || i < 1UL << (8 * entry))
+			break;
+		entry *= 2;
+	}
 
+	*out_entry = entry;
 	return i;
 }
 
+static uint32_t cache_align(uint32_t object_size, uint32_t align, uint32_t flags) {
+	if (align < alignof(void*))
+		align = alignof(void*);
+
+	// small objects may share a line, but never straddle one
+	if (flags & cache_flag_hwcache_align) {
+		uint32_t line = CACHE_LINE_SIZE;
+		while (object_size <= line / 2 && line > align)
+			line /= 2;
+		if (line > align)
+			align = line;
+	}
+
+	assert((align & (align - 1)) == 0);
+	return align;
+}
+
+static void cache_layout(struct cache *cache, uint32_t object_size, uint32_t align, uint32_t flags) {
+	align = cache_align(object_size, align, flags);
+
+	// constructed objects must survive being freed, so keep the link out of them
+	cache->link_offset = 0;
+	if (cache->ctor != NULL) {
+		cache->link_offset = round_up(object_size, alignof(void*));
+		object_size = cache->link_offset + sizeof(void*);
+	}
+
+	cache->object_size = round_up(object_size, align);
+	cache->align = align;
+	cache->flags = flags;
+
+	// the bootstrap caches hold their own headers
+	cache->off_slab = cache->object_size >= SLAB_OFF_SLAB_SIZE && cache != &slab_headers &&
+		cache != &caches && cache != &magazines;
+
+	// take the smallest slab that wastes no more than an eighth of itself, or failing that the one
+	// that wastes the fewest eighths, preferring smaller slabs on ties
+	// larger slabs only amortize the header, so they rarely win by a whole eighth, and small objects
+	// whose freelist entries alone waste over an eighth stay on single pages
+	cache->slab_capacity = 0;
+	uint64_t best_eighths = 0;
+	for (uint32_t order = 0; order <= SLAB_MAX_ORDER; order++) {
+		uint32_t entry;
+		uint32_t capacity = calc_slab_capacity(cache->object_size, align, order, cache->off_slab, &entry);
+		if (capacity == 0)
+			continue;
+
+		uint64_t slab_size = PAGE_SIZE << order;
+		uint64_t waste = slab_size - (uint64_t)capacity * cache->object_size;
+		uint64_t eighths = waste * 8 / slab_size;
+		if (cache->slab_capacity == 0 || eighths < best_eighths) {
+			cache->slab_order = order;
+			cache->slab_capacity = capacity;
+			cache->freelist_entry = entry;
+			best_eighths = eighths;
+		}
+
+		if (waste <= slab_size / 8)
+			break;
+	}
+
+	assert(cache->slab_capacity > 0);
+
+	// slab_headers only has room for byte-sized entries
+	assert(!cache->off_slab || cache->freelist_entry == sizeof(uint8_t));
+
+	cache->offset = 0;
+	if (!cache->off_slab)
+		cache->offset = round_up(sizeof(struct slab) + cache->slab_capacity * cache->freelist_entry, align);
+
+	// slide successive slabs' objects through whatever is left over at the end of the slab
+	uint32_t used = cache->offset + cache->slab_capacity * cache->object_size;
+	uint32_t unused = (PAGE_SIZE << cache->slab_order) - used;
+	cache->color_step = align > CACHE_LINE_SIZE ? align : CACHE_LINE_SIZE;
+	cache->colors = unused / cache->color_step + 1;
+	cache->color_next = 0;
+}
+
+static void cache_setup(struct cache *cache) {
+	cache->depot_lock = (struct spinlock){ 0 };
+	list_init(&cache->depot_full);
+	list_init(&cache->depot_empty);
+
+	for (uint32_t node = 0; node < NUMA_MAX_NODES; node++) {
+		struct cache_node *cache_node = &cache->nodes[node];
+		cache_node->lock = (struct spinlock){ 0 };
+		list_init(&cache_node->partial);
+		list_init(&cache_node->empty);
+		list_init(&cache_node->full);
+		cache_node->remote_slabs = NULL;
+	}
+}
+
+// per-cpu magazines follow each cache, on a line of their own
+static struct cache_cpu *cache_cpus(struct cache *cache) {
+	return (struct cache_cpu*)((char*)cache + round_up(sizeof(struct cache), CACHE_LINE_SIZE));
+}
+
 void cache_init(void) {
-	caches.slab_capacity = calc_slab_capacity(caches.object_size);
+	// every other cache carries its per-cpu magazines along with it
+	uint32_t cache_size = round_up(sizeof(struct cache), CACHE_LINE_SIZE);
+	cache_size += lapic_count * sizeof(struct cache_cpu);
+	cache_setup(&caches);
+	caches.name = "cache";
+	cache_layout(&caches, cache_size, 0, cache_flag_hwcache_align);
+	list_add_tail(&caches.link, &cache_list);
+
+	cache_setup(&magazines);
+	magazines.name = "magazine";
+	cache_layout(&magazines, sizeof(struct magazine), 0, cache_flag_hwcache_align);
+	list_add_tail(&magazines.link, &cache_list);
+
+	// off-slab capacities all fit in a byte
+	uint32_t header_size = sizeof(struct slab) + SLAB_OFF_SLAB_CAPACITY * sizeof(uint8_t);
+	cache_setup(&slab_headers);
+	slab_headers.name = "slab_header";
+	cache_layout(&slab_headers, header_size, 0, 0);
+	list_add_tail(&slab_headers.link, &cache_list);
+
+	shrinker_register(&cache_shrinker);
+
+	// natural alignment, as far as the size allows
+	for (unsigned int i = 1; i <= KMALLOC_SHIFT_MAX; i++) {
+		if (i == 1 || i == 2 || i >= KMALLOC_SHIFT_MIN) {
+			uint32_t size = kmalloc_size(i);
+			kmalloc_caches[i] = cache_create_ex(kmalloc_names[i], size, size & -size, 0, NULL);
+		}
+	}
+}
+
+struct cache *cache_create(const char *name, uint32_t object_size) {
+	return cache_create_ex(name, object_size, 0, 0, NULL);
+}
+
+// an existing cache with the same layout, to share instead of making a new one
+static struct cache *cache_find_mergeable(uint32_t object_size, uint32_t align, uint32_t flags) {
+	align = cache_align(object_size, align, flags);
+	object_size = round_up(object_size, align);
 
-	for (int i = 0; sized_caches[i].size != 0; i++)
-		sized_caches[i].cache = cache_create(sized_caches[i].size);
+	struct list *entry = cache_list.next;
+	for (; entry != &cache_list; entry = entry->next) {
+		struct cache *cache = containerof(entry, struct cache, link);
+		if (cache->refcount == 0 || cache->ctor != NULL)
+			continue;
+
+		if (cache->object_size == object_size && cache->align == align && cache->flags == flags)
+			return cache;
+	}
+
+	return NULL;
 }
 
-struct cache *cache_create(uint32_t object_size) {
+struct cache *cache_create_ex(
+	const char *name, uint32_t object_size, uint32_t align, uint32_t flags, void (*ctor)(void *object)
+) {
+	struct spinlock_node node;
+
+	if (ctor == NULL) {
+		spin_lock(&cache_list_lock, &node);
+		struct cache *cache = cache_find_mergeable(object_size, align, flags);
+		if (cache != NULL)
+			cache->refcount++;
+		spin_unlock(&cache_list_lock, &node);
+
+		if (cache != NULL)
+			return cache;
+	}
+
 	struct cache *cache = cache_alloc(&caches);
 	if (cache == NULL)
 		return NULL;
 
-	list_init(&cache->full);
-	list_init(&cache->partial);
-	list_init(&cache->empty);
+	cache_setup(cache);
+	cache->name = name;
+	cache->refcount = 1;
+	cache->ctor = ctor;
+
+	cache->cpu = cache_cpus(cache);
+	memset(cache->cpu, 0, lapic_count * sizeof(struct cache_cpu));
 
-	cache->object_size = object_size;
-	cache->slab_capacity = calc_slab_capacity(cache->object_size);
+	cache_layout(cache, object_size, align, flags);
+	cache->page_color = 0;
+
+	spin_lock(&cache_list_lock, &node);
+	list_add_tail(&cache->link, &cache_list);
+	spin_unlock(&cache_list_lock, &node);
 
 	return cache;
 }
 
-void cache_shrink(struct cache *cache) {
-	while (cache->empty.next != &cache->empty) {
-		struct slab *slab = containerof(cache->empty.next, struct slab, list);
-		list_del(cache->empty.next);
+static void slab_free(struct cache *cache, uint32_t count, void **objects);
 
-		page_free(page_from_address(slab));
+// return a magazine's objects to their slabs, and the magazine itself to its cache
+static void magazine_flush(struct cache *cache, struct magazine *magazine) {
+	slab_free(cache, magazine->rounds, magazine->objects);
+	cache_free(&magazines, magazine);
+}
+
+static struct magazine *depot_take(struct cache *cache, struct list *list);
+
+// empty out the depot so the objects it holds can be reaped
+static void depot_flush(struct cache *cache) {
+	for (;;) {
+		struct spinlock_node node;
+		spin_lock(&cache->depot_lock, &node);
+		struct magazine *magazine = depot_take(cache, &cache->depot_full);
+		if (magazine == NULL)
+			magazine = depot_take(cache, &cache->depot_empty);
+		spin_unlock(&cache->depot_lock, &node);
+
+		if (magazine == NULL)
+			break;
+		magazine_flush(cache, magazine);
 	}
 }
 
+static void node_drain_remote(struct cache *cache, struct cache_node *cache_node);
+
+// give a slab's pages back, returning how many there were
+static uint64_t slab_destroy(struct cache *cache, struct slab *slab) {
+	struct page *page = slab->page;
+	if (cache->off_slab)
+		cache_free(&slab_headers, slab);
+
+	page_free_order(page, cache->slab_order);
+	page_stats_slab(-(1L << cache->slab_order));
+	return 1UL << cache->slab_order;
+}
+
+// free up to count empty slabs, returning how many pages were freed
+static uint64_t cache_reap(struct cache *cache, uint64_t count) {
+	if (cache->cpu != NULL)
+		depot_flush(cache);
+
+	uint64_t freed = 0;
+	for (uint32_t node = 0; node < NUMA_MAX_NODES && freed < count; node++) {
+		struct cache_node *cache_node = &cache->nodes[node];
+
+		while (freed < count) {
+			struct slab *slab = NULL;
+
+			struct spinlock_node lock_node;
+			spin_lock(&cache_node->lock, &lock_node);
+			node_drain_remote(cache, cache_node);
+			if (!list_empty(&cache_node->empty)) {
+				slab = containerof(cache_node->empty.next, struct slab, list);
+				list_del(&slab->list);
+			}
+			spin_unlock(&cache_node->lock, &lock_node);
+
+			if (slab == NULL)
+				break;
+
+			freed += slab_destroy(cache, slab);
+		}
+	}
+
+	return freed;
+}
+
+void cache_shrink(struct cache *cache) {
+	cache_reap(cache, (uint64_t)-1);
+}
+
 void cache_destroy(struct cache *cache) {
+	struct spinlock_node node;
+	spin_lock(&cache_list_lock, &node);
+	bool last = --cache->refcount == 0;
+	if (last)
+		list_del(&cache->link);
+	spin_unlock(&cache_list_lock, &node);
+
+	// other callers are still using a merged cache
+	if (!last)
+		return;
+
+	// the cache must be idle by now, so other cpus' magazines are safe to take
+	for (uint32_t cpu = 0; cpu < lapic_count; cpu++) {
+		struct cache_cpu *cache_cpu = &cache->cpu[cpu];
+		if (cache_cpu->loaded != NULL)
+			magazine_flush(cache, cache_cpu->loaded);
+		if (cache_cpu->previous != NULL)
+			magazine_flush(cache, cache_cpu->previous);
+	}
+
 	cache_shrink(cache);
-	assert(list_empty(&cache->partial) && list_empty(&cache->full));
+	for (uint32_t node = 0; node < NUMA_MAX_NODES; node++)
+		assert(list_empty(&cache->nodes[node].partial) && list_empty(&cache->nodes[node].full));
 	cache_free(&caches, cache);
 }
 
+static uint32_t freelist_get(struct cache *cache, struct slab *slab, uint32_t index) {
+	switch (cache->freelist_entry) {
+	case sizeof(uint8_t): return ((uint8_t*)slab->free)[index];
+	case sizeof(uint16_t): return ((uint16_t*)slab->free)[index];
+	default: return ((uint32_t*)slab->free)[index];
+	}
+}
+
+static void freelist_set(struct cache *cache, struct slab *slab, uint32_t index, uint32_t next) {
+	switch (cache->freelist_entry) {
+	case sizeof(uint8_t): ((uint8_t*)slab->free)[index] = next; break;
+	case sizeof(uint16_t): ((uint16_t*)slab->free)[index] = next; break;
+	default: ((uint32_t*)slab->free)[index] = next; break;
+	}
+}
+
 static struct slab *slab_create(struct cache *cache) {
-	struct page *page = page_alloc();
+	struct page *page;
+	if (cache->slab_order == 0)
+		page = page_alloc_color(atomic_fetch_add_explicit(&cache->page_color, 1, memory_order_relaxed));
+	else
+		page = page_alloc_order(cache->slab_order);
 	if (page == NULL)
 		return NULL;
 
-	struct slab *slab = page_address(page);
+	char *base = page_address(page);
+
+	struct slab *slab = (struct slab*)base;
+	if (cache->off_slab) {
+		slab = cache_alloc(&slab_headers);
+		if (slab == NULL) {
+			page_free_order(page, cache->slab_order);
+			return NULL;
+		}
+	}
+
+	page_stats_slab(1L << cache->slab_order);
+
 	list_init(&slab->list);
+	slab->page = page;
+
+	// any page of the slab leads back to it
+	for (uint32_t i = 0; i < 1U << cache->slab_order; i++) {
+		page[i].cache = cache;
+		page[i].slab = slab;
+	}
 
-	page->cache = cache;
-	page->slab = slab;
+	uint32_t color = atomic_fetch_add_explicit(&cache->color_next, 1, memory_order_relaxed) % cache->colors;
+	slab->objects = base + cache->offset + color * cache->color_step;
 
-	slab->objects = (char*)slab + sizeof(struct slab) + cache->slab_capacity * sizeof(uint32_t);
+	slab->remote_free = NULL;
+	slab->remote_next = NULL;
 
 	slab->ref_count = 0;
 	slab->next_free = 0;
 	for (uint32_t i = 0; i < cache->slab_capacity; i++)
-		slab->free[i] = i + 1;
+		freelist_set(cache, slab, i, i + 1);
+
+	if (cache->ctor != NULL) {
+		for (uint32_t i = 0; i < cache->slab_capacity; i++)
+			cache->ctor((char*)slab->objects + i * cache->object_size);
+	}
 
 	return slab;
 }
 
-void *cache_alloc(struct cache *cache) {
-	struct list *entry = cache->partial.next;
+// take up to count objects off a slab's free chain, with its node locked
+static uint32_t slab_take(
+	struct cache *cache, struct cache_node *cache_node, struct slab *slab, uint32_t count, void **objects
+) {
+	uint32_t taken = 0;
+	while (taken < count && slab->next_free != cache->slab_capacity) {
+		objects[taken++] = (char*)slab->objects + slab->next_free * cache->object_size;
+		slab->next_free = freelist_get(cache, slab, slab->next_free);
+	}
 
-	if (list_empty(&cache->partial)) {
-		entry = cache->empty.next;
+	slab->ref_count += taken;
+	if (slab->next_free == cache->slab_capacity) {
+		list_del(&slab->list);
+		list_add_head(&slab->list, &cache_node->full);
+	}
 
-		if (list_empty(&cache->empty)) {
-			struct slab *slab = slab_create(cache);
-			if (slab == NULL)
-				return NULL;
+	return taken;
+}
 
-			entry = &slab->list;
-			list_add_head(entry, &cache->partial);
+// take up to count objects from a node's slabs
+static uint32_t node_alloc(
+	struct cache *cache, struct cache_node *cache_node, uint32_t count, void **objects
+) {
+	uint32_t taken = 0;
+
+	struct spinlock_node lock_node;
+	spin_lock(&cache_node->lock, &lock_node);
+	node_drain_remote(cache, cache_node);
+
+	while (taken < count) {
+		struct list *entry = cache_node->partial.next;
+		if (list_empty(&cache_node->partial)) {
+			if (list_empty(&cache_node->empty))
+				break;
+
+			entry = cache_node->empty.next;
+			list_del(entry);
+			list_add_head(entry, &cache_node->partial);
 		}
+
+		struct slab *slab = containerof(entry, struct slab, list);
+		taken += slab_take(cache, cache_node, slab, count - taken, objects + taken);
 	}
 
-	struct slab *slab = containerof(entry, struct slab, list);
-	void *object = (char*)slab->objects + slab->next_free * cache->object_size;
+	spin_unlock(&cache_node->lock, &lock_node);
+	return taken;
+}
 
-	slab->ref_count++;
-	slab->next_free = slab->free[slab->next_free];
-	if (slab->next_free == cache->slab_capacity) {
-		list_del(&slab->list);
-		list_add_head(&slab->list, &cache->full);
+static uint32_t slab_alloc(struct cache *cache, uint32_t count, void **objects) {
+	uint32_t node = node_by_cpu[SMP_PERCPU_READ(smp_id)];
+
+	uint32_t taken = node_alloc(cache, &cache->nodes[node], count, objects);
+	while (taken < count) {
+		// the page allocator may have fallen back on another node
+		struct slab *slab = slab_create(cache);
+		if (slab == NULL)
+			break;
+
+		struct cache_node *cache_node = &cache->nodes[slab->page->node];
+
+		struct spinlock_node lock_node;
+		spin_lock(&cache_node->lock, &lock_node);
+		list_add_head(&slab->list, &cache_node->partial);
+		taken += slab_take(cache, cache_node, slab, count - taken, objects + taken);
+		spin_unlock(&cache_node->lock, &lock_node);
 	}
 
-	return object;
-}
+	// out of memory- use up other nodes' slabs before failing
+	for (uint32_t i = 1; i < numa_node_count && taken < count; i++) {
+		struct cache_node *cache_node = &cache->nodes[numa_fallback[node][i]];
+		taken += node_alloc(cache, cache_node, count - taken, objects + taken);
+	}
 
-void cache_free(struct cache *cache, void *object) {
-	struct slab *slab = (struct slab*)((intptr_t)object & PAGE_MASK);
+	return taken;
+}
 
-	uint32_t index = ((char*)object - (char*)slab->objects) / cache->object_size;
-	slab->free[index] = slab->next_free;
-	slab->next_free = index;
+// return objects from the same slab to it, with its node locked
+static void slab_put(
+	struct cache *cache, struct cache_node *cache_node, struct slab *slab, uint32_t count, void **objects
+) {
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t index = ((char*)objects[i] - (char*)slab->objects) / cache->object_size;
+		freelist_set(cache, slab, index, slab->next_free);
+		slab->next_free = index;
+	}
 
 	uint32_t ref_count = slab->ref_count;
-	slab->ref_count--;
+	slab->ref_count -= count;
 	if (slab->ref_count == 0) {
 		list_del(&slab->list);
-		list_add_head(&slab->list, &cache->empty);
+		list_add_head(&slab->list, &cache_node->empty);
 	}
 	else if (ref_count == cache->slab_capacity) {
 		list_del(&slab->list);
-		list_add_head(&slab->list, &cache->partial);
+		list_add_head(&slab->list, &cache_node->partial);
+	}
+}
+
+static void **object_link(struct cache *cache, void *object) {
+	return (void**)((char*)object + cache->link_offset);
+}
+
+// queue a free from another node on its slab, leaving the slab's node to pick it up
+// this is lock-free, not wait-free- a push retries its compare-and-swap for as long as other cpus
+// keep winning the race for the same slab or node
+static void slab_free_remote(
+	struct cache *cache, struct cache_node *cache_node, struct slab *slab, void *object
+) {
+	void *head = atomic_load_explicit(&slab->remote_free, memory_order_relaxed);
+	do
+		*object_link(cache, object) = head;
+	while (!atomic_compare_exchange_weak_explicit(
+		&slab->remote_free, &head, object, memory_order_release, memory_order_relaxed
+	));
+
+	// the first remote free since the last drain puts the slab on its node's list
+	if (head != NULL)
+		return;
+
+	struct slab *next = atomic_load_explicit(&cache_node->remote_slabs, memory_order_relaxed);
+	do
+		slab->remote_next = next;
+	while (!atomic_compare_exchange_weak_explicit(
+		&cache_node->remote_slabs, &next, slab, memory_order_release, memory_order_relaxed
+	));
+}
+
+// put back everything freed from other nodes, with the node locked
+static void node_drain_remote(struct cache *cache, struct cache_node *cache_node) {
+	if (atomic_load_explicit(&cache_node->remote_slabs, memory_order_relaxed) == NULL)
+		return;
+
+	struct slab *slab = atomic_exchange_explicit(&cache_node->remote_slabs, NULL, memory_order_acquire);
+	while (slab != NULL) {
+		// read before taking the objects, after which the slab may be queued again
+		struct slab *next = slab->remote_next;
+
+		void *object = atomic_exchange_explicit(&slab->remote_free, NULL, memory_order_acq_rel);
+		while (object != NULL) {
+			void *next_object = *object_link(cache, object);
+			slab_put(cache, cache_node, slab, 1, &object);
+			object = next_object;
+		}
+
+		slab = next;
 	}
 }
 
-// TODO: fall back on large page allocation once we have large pages
-void *kmalloc(size_t size) {
-	for (int i = 0; sized_caches[i].size != 0; i++) {
-		if (size > sized_caches[i].size)
+// return objects to their slabs, locking each node once per run of objects from it
+static void slab_free(struct cache *cache, uint32_t count, void **objects) {
+	uint32_t local = node_by_cpu[SMP_PERCPU_READ(smp_id)];
+	struct cache_node *locked = NULL;
+	struct spinlock_node lock_node;
+
+	for (uint32_t i = 0; i < count; ) {
+		struct slab *slab = page_from_address(objects[i])->slab;
+		uint32_t node = slab->page->node;
+		struct cache_node *cache_node = &cache->nodes[node];
+
+		if (node != local) {
+			slab_free_remote(cache, cache_node, slab, objects[i]);
+			i++;
 			continue;
+		}
 
-		return cache_alloc(sized_caches[i].cache);
+		if (locked != cache_node) {
+			if (locked != NULL)
+				spin_unlock(&locked->lock, &lock_node);
+			locked = cache_node;
+			spin_lock(&locked->lock, &lock_node);
+		}
+
+		// consecutive objects from the same slab only move it between lists once
+		uint32_t run = 1;
+		while (i + run < count && page_from_address(objects[i + run])->slab == slab)
+			run++;
+
+		slab_put(cache, cache_node, slab, run, objects + i);
+		i += run;
 	}
 
-	return NULL;
+	if (locked != NULL)
+		spin_unlock(&locked->lock, &lock_node);
+}
+
+static void *magazine_pop(struct magazine *magazine) {
+	return magazine->objects[--magazine->rounds];
+}
+
+static void magazine_push(struct magazine *magazine, void *object) {
+	magazine->objects[magazine->rounds++] = object;
+}
+
+static struct magazine *depot_take(struct cache *cache, struct list *list) {
+	if (list_empty(list))
+		return NULL;
+
+	struct list *entry = list->next;
+	list_del(entry);
+	return containerof(entry, struct magazine, list);
+}
+
+static void *magazine_alloc(struct cache *cache, struct cache_cpu *cpu) {
+	if (cpu->loaded != NULL && cpu->loaded->rounds > 0)
+		return magazine_pop(cpu->loaded);
+
+	if (cpu->previous != NULL && cpu->previous->rounds > 0) {
+		struct magazine *previous = cpu->previous;
+		cpu->previous = cpu->loaded;
+		cpu->loaded = previous;
+		return magazine_pop(previous);
+	}
+
+	// both are empty- trade one of them for a full magazine from the depot
+	struct spinlock_node node;
+	spin_lock(&cache->depot_lock, &node);
+	struct magazine *full = depot_take(cache, &cache->depot_full);
+	if (full != NULL && cpu->previous != NULL)
+		list_add_head(&cpu->previous->list, &cache->depot_empty);
+	spin_unlock(&cache->depot_lock, &node);
+
+	if (full == NULL)
+		return NULL;
+
+	cpu->previous = cpu->loaded;
+	cpu->loaded = full;
+	return magazine_pop(full);
+}
+
+static bool magazine_free(struct cache *cache, struct cache_cpu *cpu, void *object) {
+	if (cpu->loaded != NULL && cpu->loaded->rounds < MAGAZINE_SIZE) {
+		magazine_push(cpu->loaded, object);
+		return true;
+	}
+
+	if (cpu->previous != NULL && cpu->previous->rounds == 0) {
+		struct magazine *previous = cpu->previous;
+		cpu->previous = cpu->loaded;
+		cpu->loaded = previous;
+		magazine_push(previous, object);
+		return true;
+	}
+
+	// both are full- trade one of them for an empty magazine from the depot, or a new one
+	struct spinlock_node node;
+	spin_lock(&cache->depot_lock, &node);
+	struct magazine *empty = depot_take(cache, &cache->depot_empty);
+	spin_unlock(&cache->depot_lock, &node);
+
+	if (empty == NULL) {
+		empty = cache_alloc(&magazines);
+		if (empty == NULL)
+			return false;
+		empty->rounds = 0;
+	}
+
+	if (cpu->previous != NULL) {
+		spin_lock(&cache->depot_lock, &node);
+		list_add_head(&cpu->previous->list, &cache->depot_full);
+		spin_unlock(&cache->depot_lock, &node);
+	}
+
+	cpu->previous = cpu->loaded;
+	cpu->loaded = empty;
+	magazine_push(empty, object);
+	return true;
+}
+
+void *cache_alloc(struct cache *cache) {
+	void *object;
+
+	if (cache->cpu == NULL) {
+		if (slab_alloc(cache, 1, &object) == 0)
+			return NULL;
+		return object;
+	}
+
+	struct cache_cpu *cpu = &cache->cpu[SMP_PERCPU_READ(smp_id)];
+	object = magazine_alloc(cache, cpu);
+	if (object == NULL && slab_alloc(cache, 1, &object) == 0) {
+		cpu->fail++;
+		return NULL;
+	}
+
+	cpu->alloc++;
+	return object;
+}
+
+void cache_free(struct cache *cache, void *object) {
+	if (cache->cpu != NULL) {
+		struct cache_cpu *cpu = &cache->cpu[SMP_PERCPU_READ(smp_id)];
+		cpu->free++;
+		if (magazine_free(cache, cpu, object))
+			return;
+	}
+
+	slab_free(cache, 1, &object);
+}
+
+bool cache_alloc_bulk(struct cache *cache, uint32_t count, void **objects) {
+	uint32_t taken = 0;
+
+	// drain the loaded magazine first, then go to the slabs for the rest in one go
+	struct cache_cpu *cpu = NULL;
+	if (cache->cpu != NULL) {
+		cpu = &cache->cpu[SMP_PERCPU_READ(smp_id)];
+		while (cpu->loaded != NULL && cpu->loaded->rounds > 0 && taken < count)
+			objects[taken++] = magazine_pop(cpu->loaded);
+	}
+
+	if (taken < count)
+		taken += slab_alloc(cache, count - taken, objects + taken);
+
+	if (cpu != NULL) {
+		cpu->alloc += taken;
+		if (taken < count)
+			cpu->fail++;
+	}
+
+	if (taken < count) {
+		cache_free_bulk(cache, taken, objects);
+		return false;
+	}
+
+	return true;
+}
+
+void cache_free_bulk(struct cache *cache, uint32_t count, void **objects) {
+	uint32_t done = 0;
+
+	// top off the loaded magazine, then hand the rest back to the slabs in one go
+	if (cache->cpu != NULL) {
+		struct cache_cpu *cpu = &cache->cpu[SMP_PERCPU_READ(smp_id)];
+		cpu->free += count;
+		while (cpu->loaded != NULL && cpu->loaded->rounds < MAGAZINE_SIZE && done < count)
+			magazine_push(cpu->loaded, objects[done++]);
+	}
+
+	slab_free(cache, count - done, objects + done);
+}
+
+static void count_slabs(struct list *list, uint64_t *slabs, uint64_t *active) {
+	for (struct list *entry = list->next; entry != list; entry = entry->next) {
+		(*slabs)++;
+		*active += containerof(entry, struct slab, list)->ref_count;
+	}
+}
+
+void cache_stats(struct cache *cache, struct cache_stats *out) {
+	*out = (struct cache_stats){
+		.name = cache->name,
+		.users = cache->refcount,
+		.object_size = cache->object_size,
+		.slab_capacity = cache->slab_capacity,
+		.slab_pages = 1U << cache->slab_order,
+	};
+
+	for (uint32_t node = 0; node < NUMA_MAX_NODES; node++) {
+		struct cache_node *cache_node = &cache->nodes[node];
+
+		struct spinlock_node lock_node;
+		spin_lock(&cache_node->lock, &lock_node);
+		count_slabs(&cache_node->full, &out->slabs_full, &out->active);
+		count_slabs(&cache_node->partial, &out->slabs_partial, &out->active);
+		count_slabs(&cache_node->empty, &out->slabs_empty, &out->active);
+		spin_unlock(&cache_node->lock, &lock_node);
+	}
+
+	uint64_t slabs = out->slabs_full + out->slabs_partial + out->slabs_empty;
+	out->total = slabs * cache->slab_capacity;
+	out->pages = slabs << cache->slab_order;
+
+	if (cache->cpu == NULL)
+		return;
+
+	struct spinlock_node lock_node;
+	spin_lock(&cache->depot_lock, &lock_node);
+	struct list *entry = cache->depot_full.next;
+	for (; entry != &cache->depot_full; entry = entry->next)
+		out->cached += containerof(entry, struct magazine, list)->rounds;
+	spin_unlock(&cache->depot_lock, &lock_node);
+
+	// other cpus' magazines and counters are read without synchronization, so may be slightly off
+	for (uint32_t cpu = 0; cpu < lapic_count; cpu++) {
+		struct cache_cpu *cache_cpu = &cache->cpu[cpu];
+		struct magazine *loaded = cache_cpu->loaded, *previous = cache_cpu->previous;
+		if (loaded != NULL)
+			out->cached += loaded->rounds;
+		if (previous != NULL)
+			out->cached += previous->rounds;
+
+		out->alloc += cache_cpu->alloc;
+		out->free += cache_cpu->free;
+		out->fail += cache_cpu->fail;
+	}
+}
+
+void cache_stats_dump(void) {
+	kprintf(
+		"cache: %-16s %6s %8s %8s %8s %6s %6s %6s %6s %10s %10s %6s\n", "name", "size",
+		"active", "total", "cached", "full", "part", "empty", "pages", "alloc", "free", "fail"
+	);
+
+	struct spinlock_node node;
+	spin_lock(&cache_list_lock, &node);
+
+	struct list *entry = cache_list.next;
+	for (; entry != &cache_list; entry = entry->next) {
+		struct cache_stats stats;
+		cache_stats(containerof(entry, struct cache, link), &stats);
+
+		kprintf(
+			"cache: %-16s %6u %8lu %8lu %8lu %6lu %6lu %6lu %6lu %10lu %10lu %6lu\n",
+			stats.name, stats.object_size, stats.active, stats.total, stats.cached,
+			stats.slabs_full, stats.slabs_partial, stats.slabs_empty, stats.pages,
+			stats.alloc, stats.free, stats.fail
+		);
+	}
+
+	spin_unlock(&cache_list_lock, &node);
+}
+
+// blocks too big for any cache come straight from the page allocator
+static void *kmalloc_large(size_t size) {
+	unsigned int order = 0;
+	while ((PAGE_SIZE << order) < size) {
+		order++;
+		if (order > PAGE_MAX_ORDER)
+			return NULL;
+	}
+
+	struct page *page = page_alloc_order(order);
+	if (page == NULL)
+		return NULL;
+
+	page->flags |= page_flag_kmalloc;
+	return page_address(page);
+}
+
+void *kmalloc_variable(size_t size) {
+	unsigned int index;
+	if (size <= KMALLOC_SMALL_MAX)
+		index = size_index[(size + 7) >> 3];
+	else if (size <= KMALLOC_MAX_SIZE)
+		index = 64 - __builtin_clzl(size - 1);
+	else
+		return kmalloc_large(size);
+
+	return cache_alloc(kmalloc_caches[index]);
 }
 
 void kfree(void *ptr) {
@@ -192,5 +1013,11 @@ void kfree(void *ptr) {
 		return;
 
 	struct page *page = page_from_address(ptr);
+	if (page->flags & page_flag_kmalloc) {
+		page->flags &= ~page_flag_kmalloc;
+		page_free_order(page, page->order);
+		return;
+	}
+
 	cache_free(page->cache, ptr);
 }
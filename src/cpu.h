@@ -18,6 +18,12 @@ static inline void cpuid(uint32_t i, uint32_t *eax, uint32_t *ebx, uint32_t *ecx
 	__asm__ volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(i));
 }
 
+static inline void cpuid_count(
+	uint32_t i, uint32_t j, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx
+) {
+	__asm__ volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(i), "c"(j));
+}
+
 enum cpuid_flags {
 	cpuid_01_ecx_x2apic = 1 << 21,
 };
@@ -26,8 +32,10 @@ enum cpuid_flags {
 
 enum msr {
 	ia32_apic_base = 0x1b,
+	ia32_pat = 0x277,
 	x2apic_base = 0x800,
 };
+static const uint32_t ia32_gs_base = 0xc0000101;
 
 enum msr_flags {
 	apic_x2apic_enable = 1 << 10,
@@ -1,7 +1,9 @@
 #include "hpet.h"
 #include "cpu.h"
+#include "vmap.h"
 #include <paging.h>
 #include <kprintf.h>
+#include <assert.h>
 
 struct hpet {
 	uint64_t capabilities;
@@ -40,11 +42,8 @@ enum hpet_timer_flags {
 static volatile struct hpet *hpet;
 
 void hpet_init(uint64_t hpet_address) {
-	// TODO: factor out temporary mappings
-	extern uint64_t kernel_pml4[], pt_map[];
-	pt_map[1] = hpet_address | PAGE_PRESENT | PAGE_WRITE | PAGE_CACHE_UC | PAGE_GLOBAL;
-	write_cr3(PHYS_KERNEL(kernel_pml4));
-	hpet = (volatile struct hpet*)0xffffffffc0001000;
+	hpet = ioremap(hpet_address, sizeof(struct hpet));
+	assert(hpet != NULL);
 
 	uint8_t max_timer = (hpet->capabilities >> hpet_timers_shift) & hpet_timers_mask;
 
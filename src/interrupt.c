@@ -76,6 +76,19 @@ void page_fault(struct registers *registers) {
 	for (;;);
 }
 
+static void idt_load(void) {
+	struct idt_pointer {
+		uint16_t limit;
+		uint64_t base;
+	} __attribute__((packed)) idt_ptr = {
+		.limit = sizeof(idt) - sizeof(*idt),
+		.base = (uint64_t)idt,
+	};
+
+	extern void load_idt(struct idt_pointer*);
+	load_idt(&idt_ptr);
+}
+
 void interrupt_init() {
 	for (int i = 0; i < 32; i++) {
 		idt[i] = IDT_ENTRY((uint64_t)default_exception, SEG_KERNEL_CODE, IDT_TRAP);
@@ -89,15 +102,16 @@ void interrupt_init() {
 	idt[13] = IDT_ENTRY((uint64_t)isr_general_protection_fault, SEG_KERNEL_CODE, IDT_TRAP);
 	idt[14] = IDT_ENTRY((uint64_t)isr_page_fault, SEG_KERNEL_CODE, IDT_TRAP);
 	idt[39] = IDT_ENTRY((uint64_t)spurious_interrupt, SEG_KERNEL_CODE, IDT_TRAP);
+	idt[interrupt_spurious] = IDT_ENTRY((uint64_t)spurious_interrupt, SEG_KERNEL_CODE, IDT_TRAP);
 
-	struct idt_pointer {
-		uint16_t limit;
-		uint64_t base;
-	} __attribute__((packed)) idt_ptr = {
-		.limit = sizeof(idt) - sizeof(*idt),
-		.base = (uint64_t)idt,
-	};
+	idt_load();
+}
 
-	extern void load_idt(struct idt_pointer*);
-	load_idt(&idt_ptr);
+// the aps share the bsp's idt
+void interrupt_init_ap(void) {
+	idt_load();
+}
+
+void interrupt_set(uint8_t vector, void (*isr)(void)) {
+	idt[vector] = IDT_ENTRY((uint64_t)isr, SEG_KERNEL_CODE, IDT_INTERRUPT);
 }
@@ -1 +1,18 @@
+#include <stdint.h>
+
+// vectors of interrupts the kernel raises itself- the legacy pic's spurious irqs sit at [0x20, 0x30)
+enum interrupt_vector {
+	interrupt_apic_timer = 0x30,
+	interrupt_wakeup = 0xf0,
+	interrupt_flush = 0xf1,
+	interrupt_spurious = 0xff,
+};
+
+struct registers;
+
 void interrupt_init(void);
+void interrupt_init_ap(void);
+
+// point vector at an isr_* stub from entry.S- its handler runs with interrupts disabled,
+// and sends its own eoi
+void interrupt_set(uint8_t vector, void (*isr)(void));
@@ -14,9 +14,211 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
+
+// the serial port isn't wired up to an interrupt, so the bsp wakes up this often to poll it
+#define CONSOLE_POLL_HZ 20
+
+// a 4M buffer, bigger than most l2s, written this many times per memory type
+#define STREAM_BENCH_PASSES 64
+
+// time streaming stores to a buffer through the direct map, first write-back, then write-combining
+static void stream_bench(void) {
+	// the kernel mapping keeps the first 1G write-back, and a second, write-combining alias of the
+	// same memory would be undefined, so set aside blocks until one lands above it
+	struct list low = LIST_INIT(low);
+
+	struct page *page;
+	while ((page = page_alloc_order(PAGE_MAX_ORDER)) != NULL) {
+		if (PHYS_DIRECT(page_address(page)) >= PDPT_SIZE)
+			break;
+		list_add_tail(&page->free, &low);
+	}
+
+	while (!list_empty(&low)) {
+		struct page *block = containerof(low.next, struct page, free);
+		list_del(&block->free);
+		page_free_order(block, PAGE_MAX_ORDER);
+	}
+
+	if (page == NULL) {
+		kprintf("stream: no memory above 1G\n");
+		return;
+	}
+
+	uint64_t buffer = (uint64_t)page_address(page);
+	uint64_t size = PAGE_SIZE << PAGE_MAX_ORDER;
+
+	static const struct {
+		const char *name;
+		uint64_t cache;
+	} types[] = {
+		{ "wb", PAGE_CACHE_WB },
+		{ "wc", PAGE_CACHE_WC },
+	};
+
+	for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++) {
+		paging_set_cache(buffer, size, types[i].cache);
+
+		uint64_t start = rdtsc();
+		for (int pass = 0; pass < STREAM_BENCH_PASSES; pass++) {
+			uint64_t address = buffer, count = size / sizeof(uint64_t);
+			__asm__ volatile ("rep stosq; sfence" : "+D"(address), "+c"(count) : "a"(0UL) : "memory");
+		}
+		uint64_t cycles = rdtsc() - start;
+
+		uint64_t bytes = size * STREAM_BENCH_PASSES;
+		kprintf("stream: %s %lu MiB/s\n", types[i].name, (bytes * tsc_frequency / cycles) >> 20);
+	}
+
+	// the frames go back to the allocator with the same type as the rest of the direct map
+	paging_set_cache(buffer, size, PAGE_CACHE_WB);
+	page_free_order(page, PAGE_MAX_ORDER);
+}
+
+// pages per color in each buffer of the page coloring benchmark- spread over every color they fit
+// in any cache with at least this many ways, and piled on one color they don't
+#define COLOR_BENCH_PER_COLOR 8
+#define COLOR_BENCH_PASSES 16
+
+// the cycles a read of each line of pages takes, once the first pass has warmed the cache
+static uint64_t color_bench_walk(struct list *pages, uint64_t count) {
+	uint64_t start = 0;
+	for (int pass = 0; pass <= COLOR_BENCH_PASSES; pass++) {
+		if (pass == 1)
+			start = rdtsc();
+
+		for (struct list *l = pages->next; l != pages; l = l->next) {
+			volatile uint64_t *line = page_address(containerof(l, struct page, free));
+			for (size_t i = 0; i < PAGE_SIZE / 64; i++)
+				(void)line[i * 64 / sizeof(*line)];
+		}
+	}
+
+	uint64_t cycles = rdtsc() - start;
+	return cycles / (COLOR_BENCH_PASSES * count * (PAGE_SIZE / 64));
+}
+
+// walk equal buffers with frames spread over every color, with frames from page_alloc, and with
+// every frame on one color, where they conflict in the cache
+static void color_bench(void) {
+	uint32_t colors = page_color_count();
+	if (colors == 1) {
+		kprintf("color: no cache colors\n");
+		return;
+	}
+
+	static const char *const names[] = { "colored", "uncolored", "one color" };
+	uint64_t count = colors * COLOR_BENCH_PER_COLOR;
+
+	for (size_t buffer = 0; buffer < sizeof(names) / sizeof(*names); buffer++) {
+		struct list pages = LIST_INIT(pages);
+
+		uint64_t allocated = 0;
+		for (; allocated < count; allocated++) {
+			struct page *page;
+			if (buffer == 0)
+				page = page_alloc_color(allocated % colors);
+			else if (buffer == 1)
+				page = page_alloc();
+			else
+				page = page_alloc_color(0);
+			if (page == NULL)
+				break;
+
+			list_add_tail(&page->free, &pages);
+		}
+
+		if (allocated == count)
+			kprintf("color: %s %lu cycles/access\n", names[buffer], color_bench_walk(&pages, count));
+		else
+			kprintf("color: %s no memory\n", names[buffer]);
+
+		while (!list_empty(&pages)) {
+			struct page *page = containerof(pages.next, struct page, free);
+			list_del(&page->free);
+			page_free(page);
+		}
+	}
+}
+
+// kmalloc/kfree pairs each cpu makes per round of the allocator scaling benchmark, in batches
+#define ALLOC_BENCH_OPS (1 << 20)
+#define ALLOC_BENCH_BATCH 32
+#define ALLOC_BENCH_SIZE 64
+
+static struct {
+	uint32_t ready;
+	uint32_t done;
+	bool go;
+} alloc_bench_round;
+
+static void alloc_bench_cpu(void *arg) {
+	atomic_fetch_add_explicit(&alloc_bench_round.ready, 1, memory_order_relaxed);
+	while (!atomic_load_explicit(&alloc_bench_round.go, memory_order_acquire))
+		__asm__ volatile ("pause");
+
+	void *objects[ALLOC_BENCH_BATCH];
+	for (int i = 0; i < ALLOC_BENCH_OPS / ALLOC_BENCH_BATCH; i++) {
+		for (int j = 0; j < ALLOC_BENCH_BATCH; j++)
+			objects[j] = kmalloc(ALLOC_BENCH_SIZE);
+		for (int j = 0; j < ALLOC_BENCH_BATCH; j++)
+			kfree(objects[j]);
+	}
+
+	atomic_fetch_add_explicit(&alloc_bench_round.done, 1, memory_order_release);
+}
+
+// time kmalloc and kfree on 1, 2, ... n cpus at once- with perfect scaling, the cycles each cpu
+// spends per pair stay flat as cpus are added
+static void alloc_bench(void) {
+	for (uint32_t cpus = 1; cpus <= smp_cpu_count(); cpus++) {
+		alloc_bench_round.ready = 0;
+		alloc_bench_round.done = 0;
+		atomic_store_explicit(&alloc_bench_round.go, false, memory_order_release);
+
+		// this cpu takes part too
+		uint32_t helpers = 0;
+		for (uint32_t cpu = 0; cpu < lapic_count && helpers < cpus - 1; cpu++)
+			helpers += smp_run(cpu, alloc_bench_cpu, NULL);
+
+		while (atomic_load_explicit(&alloc_bench_round.ready, memory_order_relaxed) < helpers)
+			__asm__ volatile ("pause");
+
+		uint64_t start = rdtsc();
+		atomic_store_explicit(&alloc_bench_round.go, true, memory_order_release);
+		alloc_bench_cpu(NULL);
+		while (atomic_load_explicit(&alloc_bench_round.done, memory_order_acquire) < helpers + 1)
+			__asm__ volatile ("pause");
+		uint64_t cycles = rdtsc() - start;
+
+		uint64_t ops = (uint64_t)(helpers + 1) * ALLOC_BENCH_OPS;
+		kprintf(
+			"alloc: %u cpus %lu cycles/pair per cpu, %lu kpairs/s\n",
+			helpers + 1, cycles / ALLOC_BENCH_OPS, ops * tsc_frequency / cycles / 1000
+		);
+	}
+}
+
+// allocator reports and benchmarks on request from the serial console
+static bool console_poll(void) {
+	if (!serial_available(COM1))
+		return false;
+
+	switch (serial_read(COM1)) {
+	case 'p': page_stats_dump(); break;
+	case 's': cache_stats_dump(); break;
+	case 'w': stream_bench(); break;
+	case 'a': alloc_bench(); break;
+	case 'c': color_bench(); break;
+	}
+
+	return true;
+}
 
 void kernel_init(void *memory_map, size_t map_size, size_t desc_size, void *Rsdp) {
 	interrupt_init();
+	paging_init_pat();
 	serial_init(COM1);
 	paging_init(memory_map, map_size, desc_size);
 
@@ -39,11 +241,26 @@ void kernel_init(void *memory_map, size_t map_size, size_t desc_size, void *Rsdp
 		panic("acpi error %d\n", status);
 #endif
 
+	smp_finish();
+
 	// clear identity mapping
 	extern uint64_t kernel_pml4[];
 	kernel_pml4[0] = 0;
 	write_cr3(PHYS_KERNEL(kernel_pml4));
 
+	// help the aps finish initializing memory
+	page_init_deferred();
+
 	__asm__ volatile ("sti");
-	while (true) __asm__ ("hlt");
+
+	// startup code and data are only needed until every cpu is up
+	// the aps ran it through global mappings, so every tlb must drop them before the frames are reused
+	extern char startup_begin[], startup_end[];
+	paging_unmap_lazy((uint64_t)startup_begin, startup_end - startup_begin);
+	smp_flush_all(false);
+	page_free_range(PHYS_KERNEL(startup_begin), startup_end - startup_begin);
+	kprintf("init: freed %lu KiB of startup memory\n", (startup_end - startup_begin) / 1024);
+
+	apic_timer_start(CONSOLE_POLL_HZ);
+	smp_idle(console_poll);
 }
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 // TODO: move these somewhere useful
 #define min(x, y) ((x) < (y) ? (x) : (y))
@@ -21,6 +22,7 @@ struct memory_region {
 	uint64_t size;
 };
 
+// enough for most machines- both maps move to a bigger block below 1G when either fills up
 static struct memory_region memory_regions[128];
 static struct memory_region reserved_regions[128];
 
@@ -36,71 +38,86 @@ static struct memory_map reserved = {
 	.regions = reserved_regions,
 };
 
-// insert a non-overlapping, ordered region into map
-static void memory_map_insert(struct memory_map *map, size_t i, uint64_t base, uint64_t size) {
-	assert(map->count <= map->capacity);
+// no free memory lies below this- reserving memory can only raise it, and adding memory resets it
+static uint64_t free_cursor;
 
-	struct memory_region *region = &map->regions[i];
-	memmove(region + 1, region, (map->count - i) * sizeof(*region));
-	region->base = base;
-	region->size = size;
+// index of the first region in map that ends at or after address
+static size_t memory_map_search(struct memory_map *map, uint64_t address) {
+	size_t low = 0, high = map->count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		struct memory_region *region = &map->regions[mid];
 
-	map->count++;
+		if (region->base + region->size < address)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
 }
 
-// coalesce adjacent regions in map
-static void memory_map_merge(struct memory_map *map) {
-	size_t i = 1;
-	while (i < map->count) {
-		struct memory_region *this = &map->regions[i - 1];
-		struct memory_region *next = &map->regions[i];
+static void memory_map_add(struct memory_map *map, uint64_t base, uint64_t size);
 
-		if (this->base + this->size != next->base) {
-			assert(this->base + this->size <= next->base);
-			i++;
-			continue;
-		}
+// move both maps into a block with twice the capacity- the old block, if it isn't one of the
+// static arrays, stays reserved, but growth is geometric so that wastes at most as much again
+static void memory_maps_grow(void) {
+	size_t capacity = 2 * max(memory.capacity, reserved.capacity);
+	uint64_t size = align(2 * capacity * sizeof(struct memory_region), PAGE_SIZE);
 
-		this->size += next->size;
-		memmove(next, next + 1, (map->count - i) * sizeof(*next));
-		map->count--;
-	}
-}
+	// the first gigabyte of the direct map is always mapped, even during paging_init
+	uint64_t phys = memory_find(PAGE_SIZE, min(memory_end(), PDPT_SIZE), size, PAGE_SIZE);
+	assert(phys != 0);
 
-// add a new region to map, taking care of overlaps
-static void memory_map_add(struct memory_map *map, uint64_t base, uint64_t size) {
-	uint64_t end = base + size;
+	struct memory_region *regions = VIRT_DIRECT(phys);
+	memcpy(regions, memory.regions, memory.count * sizeof(*regions));
+	memcpy(regions + capacity, reserved.regions, reserved.count * sizeof(*regions));
 
-	size_t i;
-	for (i = 0; i < map->count; i++) {
-		struct memory_region *region = &map->regions[i];
-		uint64_t region_end = region->base + region->size;
+	memory.regions = regions;
+	memory.capacity = capacity;
+	reserved.regions = regions + capacity;
+	reserved.capacity = capacity;
 
-		// skip regions fully below the new one
-		if (region_end <= base)
-			continue;
+	// there is room for this now
+	memory_map_add(&reserved, phys, size);
+}
 
-		// stop for regions fully above the new one
-		if (region->base >= end)
-			break;
+// add a new region to map, merging it with any regions it overlaps or touches
+static void memory_map_add(struct memory_map *map, uint64_t base, uint64_t size) {
+	assert(map->count < map->capacity);
 
-		// insert the piece of new region below
-		if (region->base > base)
-			memory_map_insert(map, i++, base, region->base - base);
+	uint64_t end = base + size;
 
-		base = min(region_end, end);
+	// regions [first, last) overlap or touch the new one, and are replaced by their union with it
+	size_t first = memory_map_search(map, base);
+	size_t last = first;
+	while (last < map->count && map->regions[last].base <= end) {
+		struct memory_region *region = &map->regions[last];
+		base = min(base, region->base);
+		end = max(end, region->base + region->size);
+		last++;
 	}
 
-	// insert any leftover piece of new region
-	if (base < end)
-		memory_map_insert(map, i, base, end - base);
+	struct memory_region *region = &map->regions[first];
+	if (last != first + 1)
+		memmove(region + 1, &map->regions[last], (map->count - last) * sizeof(*region));
+	map->count -= last - first;
+	map->count++;
+
+	region->base = base;
+	region->size = end - base;
 
-	memory_map_merge(map);
+	// grow as soon as the map fills rather than on the next add- by then a caller like memory_alloc
+	// has usually picked a range with memory_find and not reserved it yet, so growing could pick
+	// the same one
+	if (map->count == map->capacity)
+		memory_maps_grow();
 }
 
 // add a region of available memory
 void memory_add(uint64_t base, uint64_t size) {
 	memory_map_add(&memory, base, size);
+	free_cursor = 0;
 }
 
 // reserve a region of memory
@@ -178,13 +195,30 @@ uint64_t memory_end() {
 	return memory.regions[memory.count - 1].base + memory.regions[memory.count - 1].size;
 }
 
+// a free_next iterator that skips everything ending below start
+static uint64_t memory_free_seek(uint64_t start) {
+	uint64_t ia = memory_map_search(&memory, start);
+	uint64_t ie = memory_map_search(&reserved, start);
+	return ia | ie << 32;
+}
+
 // find a free region in [start, end) with a power-of-two alignment
 uint64_t memory_find(uint64_t start, uint64_t end, uint64_t size, uint64_t align) {
-	uint64_t i = 0, found_start, found_end;
+	// there is nothing to find below the cursor, and whatever is found first becomes the new one
+	bool from_cursor = start <= free_cursor;
+	if (from_cursor)
+		start = free_cursor;
+
+	uint64_t i = memory_free_seek(start), found_start, found_end;
 	while (memory_free_next(&i, &found_start, &found_end), i != (uint64_t)-1) {
 		found_start = clamp(found_start, start, end);
 		found_end = clamp(found_end, start, end);
 
+		if (from_cursor && found_start < found_end) {
+			free_cursor = found_start;
+			from_cursor = false;
+		}
+
 		uint64_t align_start = align(found_start, align);
 		assert(align_start != 0); // TODO: remove this after unconditionally reserving first page?
 		if (align_start < found_end && found_end - align_start >= size)
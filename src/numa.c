@@ -0,0 +1,144 @@
+#include "numa.h"
+#include "smp.h"
+#include "apic.h"
+#include <kprintf.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+// acpi proximity domains are sparse 32-bit ids, nodes are dense indices
+static uint32_t node_domains[NUMA_MAX_NODES];
+uint32_t numa_node_count = 0;
+
+static uint8_t node_distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+uint8_t numa_fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+uint8_t node_by_cpu[256];
+
+// memory affinity ranges, ordered by base
+static struct numa_range {
+	uint64_t base;
+	uint64_t end;
+	uint32_t node;
+} numa_ranges[64];
+static uint32_t numa_range_count = 0;
+
+static bool domain_node(uint32_t domain, uint32_t *out_node) {
+	for (uint32_t node = 0; node < numa_node_count; node++) {
+		if (node_domains[node] == domain) {
+			*out_node = node;
+			return true;
+		}
+	}
+
+	if (numa_node_count == NUMA_MAX_NODES) {
+		kprintf("numa: ignoring domain %u, too many nodes\n", domain);
+		return false;
+	}
+
+	*out_node = numa_node_count;
+	node_domains[numa_node_count++] = domain;
+	return true;
+}
+
+void numa_add_memory(uint32_t domain, uint64_t base, uint64_t size) {
+	uint32_t node;
+	if (!domain_node(domain, &node))
+		return;
+
+	if (numa_range_count == sizeof(numa_ranges) / sizeof(*numa_ranges)) {
+		kprintf("numa: ignoring [%#015lx-%#015lx), too many ranges\n", base, base + size);
+		return;
+	}
+
+	uint32_t i = numa_range_count++;
+	for (; i > 0 && numa_ranges[i - 1].base > base; i--)
+		numa_ranges[i] = numa_ranges[i - 1];
+	numa_ranges[i] = (struct numa_range){ base, base + size, node };
+
+	kprintf("numa: [%#015lx-%#015lx) node %u (domain %u)\n", base, base + size, node, domain);
+}
+
+void numa_add_cpu(uint32_t domain, uint32_t apic_id) {
+	uint32_t node;
+	if (!domain_node(domain, &node))
+		return;
+
+	for (uint32_t cpu = 0; cpu < lapic_count; cpu++) {
+		if (lapic_by_cpu[cpu] == apic_id)
+			node_by_cpu[cpu] = node;
+	}
+}
+
+void numa_set_distance(uint32_t from_domain, uint32_t to_domain, uint8_t distance) {
+	uint32_t from, to;
+	for (from = 0; from < numa_node_count && node_domains[from] != from_domain; from++);
+	for (to = 0; to < numa_node_count && node_domains[to] != to_domain; to++);
+	if (from == numa_node_count || to == numa_node_count)
+		return;
+
+	node_distance[from][to] = distance;
+}
+
+// fill in missing distances and sort each node's fallback list
+void numa_init(void) {
+	if (numa_node_count == 0)
+		numa_node_count = 1;
+
+	for (uint32_t from = 0; from < numa_node_count; from++) {
+		for (uint32_t to = 0; to < numa_node_count; to++) {
+			if (node_distance[from][to] == 0)
+				node_distance[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+		}
+
+		// insertion sort by distance, with the local node first even given a broken slit
+		uint8_t *fallback = numa_fallback[from];
+		for (uint32_t to = 0; to < numa_node_count; to++) {
+			uint32_t distance = to == from ? 0 : node_distance[from][to];
+
+			uint32_t i = to;
+			while (
+				i > 0 && fallback[i - 1] != from &&
+				node_distance[from][fallback[i - 1]] > distance
+			) {
+				fallback[i] = fallback[i - 1];
+				i--;
+			}
+			fallback[i] = to;
+		}
+	}
+
+	if (numa_node_count > 1) {
+		for (uint32_t from = 0; from < numa_node_count; from++) {
+			kprintf("numa: node %u distances", from);
+			for (uint32_t to = 0; to < numa_node_count; to++)
+				kprintf(" %u", node_distance[from][to]);
+			kprintf("\n");
+		}
+	}
+}
+
+// node that owns the memory at phys, and the end of that node's range
+// memory outside any affinity range is treated as belonging to node 0
+uint32_t numa_node_of(uint64_t phys, uint64_t *out_end) {
+	uint64_t end = (uint64_t)-1;
+	for (uint32_t i = 0; i < numa_range_count; i++) {
+		struct numa_range *range = &numa_ranges[i];
+		if (phys < range->base) {
+			end = range->base;
+			break;
+		}
+
+		if (phys < range->end) {
+			if (out_end != NULL)
+				*out_end = range->end;
+			return range->node;
+		}
+	}
+
+	if (out_end != NULL)
+		*out_end = end;
+	return 0;
+}
@@ -0,0 +1,16 @@
+#include <stdint.h>
+
+#define NUMA_MAX_NODES 16
+
+void numa_add_memory(uint32_t domain, uint64_t base, uint64_t size);
+void numa_add_cpu(uint32_t domain, uint32_t apic_id);
+void numa_set_distance(uint32_t from_domain, uint32_t to_domain, uint8_t distance);
+void numa_init(void);
+
+uint32_t numa_node_of(uint64_t phys, uint64_t *out_end);
+
+extern uint32_t numa_node_count;
+extern uint8_t node_by_cpu[256];
+
+// nodes ordered by distance from each node, starting with the node itself
+extern uint8_t numa_fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
@@ -1,58 +1,1074 @@
 #include "page.h"
 #include "memory.h"
+#include "numa.h"
+#include "smp.h"
+#include "apic.h"
+#include "spinlock.h"
+#include "cpu.h"
 #include <paging.h>
+#include <kprintf.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
 #include <stdalign.h>
 #include <limits.h>
 
-// TODO: larger pages
+// descriptors are mapped in sections, leaving holes in the physical address space unbacked
+// blocks never cross a section, so a block's buddy is always backed
+#define SECTION_SHIFT 27
+#define SECTION_FRAMES (1UL << (SECTION_SHIFT - PAGE_SHIFT))
+#define SECTION_MEMMAP_SIZE (SECTION_FRAMES * sizeof(struct page))
+
+_Static_assert(SECTION_MEMMAP_SIZE % PAGE_SIZE == 0, "section memmap must be whole pages");
+_Static_assert(SECTION_SHIFT - PAGE_SHIFT > PAGE_MAX_ORDER, "sections must hold whole blocks");
 
 static uint64_t num_frames;
-static struct page *page_frames;
-static struct list free_pages;
+static struct page *const page_frames = (struct page*)MEMMAP_BASE;
 
-void page_alloc_init(void) {
-	// TODO: allocate page_frames on a page boundary and map it to a fixed location
-	num_frames = memory_end() >> PAGE_SHIFT;
-	page_frames = memory_alloc(
-		PAGE_SIZE, memory_end(), num_frames * sizeof(*page_frames), alignof(*page_frames)
-	);
+// with coloring on, free single frames are bucketed by which slice of the last level cache they
+// map to, so allocations can be spread across colors instead of evicting each other
+#define PAGE_COLORING 1
+#define PAGE_COLORS_MAX 128
 
-	list_init(&free_pages);
-	for (uint64_t i = 0; i < num_frames; i++) {
-		page_frames[i].ref_count = 1;
-		list_init(&page_frames[i].free);
+static uint32_t page_colors = 1;
+
+// free blocks of 2^order pages from one numa node, each naturally aligned to its size
+struct page_pool {
+	struct spinlock lock;
+	struct list free_areas[PAGE_MAX_ORDER + 1];
+
+	// single frames by color, in place of free_areas[0] when coloring
+	struct list free_colors[PAGE_COLORS_MAX];
+	uint32_t next_color;
+
+	// free list lengths, including all the color buckets for order 0
+	uint64_t free_blocks[PAGE_MAX_ORDER + 1];
+};
+
+static struct page_pool page_pools[NUMA_MAX_NODES];
+
+// per-cpu cache of single frames, refilled from and drained to the pools in batches
+// recently freed (hot) frames go on the head, cold ones on the tail
+#define PAGE_CACHE_BATCH 16
+#define PAGE_CACHE_HIGH 64
+
+struct page_cache {
+	struct list pages;
+	uint32_t count;
+};
+
+static SMP_PERCPU struct page_cache page_cache;
+
+// frames already cleared by idle cpus, handed out by page_alloc_zeroed
+// idle cpus start refilling a node's pool below the low watermark and stop at the high one
+#define ZERO_POOL_LOW 64
+#define ZERO_POOL_HIGH 512
+#define ZERO_POOL_BATCH 8
+
+struct zero_pool {
+	struct spinlock lock;
+	struct list pages;
+	uint32_t count;
+	bool refilling;
+};
+
+static struct zero_pool zero_pools[NUMA_MAX_NODES];
+
+// per-cpu event counters, summed up only when read
+static SMP_PERCPU struct page_cpu_stats page_cpu_stats;
+
+// frames of ram, and frames handed to the pools
+static uint64_t total_frames;
+static uint64_t managed_frames;
+
+static inline uint32_t local_node(void) {
+	return node_by_cpu[SMP_PERCPU_READ(smp_id)];
+}
+
+static inline struct list *free_list(struct page_pool *pool, uint64_t frame, unsigned int order) {
+	if (order == 0 && page_colors > 1)
+		return &pool->free_colors[frame & (page_colors - 1)];
+
+	return &pool->free_areas[order];
+}
+
+// whether a block of 2^order frames includes a frame of the given color
+static inline bool block_has_color(uint64_t frame, unsigned int order, uint32_t color) {
+	return (1UL << order) >= page_colors || ((color - frame) & (page_colors - 1)) < (1UL << order);
+}
+
+static struct page *free_list_take(struct page_pool *pool, struct list *list, unsigned int order) {
+	struct page *page = containerof(list->next, struct page, free);
+	list_del(&page->free);
+	page->flags &= ~page_flag_buddy;
+	pool->free_blocks[order]--;
+	return page;
+}
+
+// return a block to its pool, merging it with its buddy as long as the buddy is free
+static void buddy_free(struct page_pool *pool, uint64_t frame, unsigned int order) {
+	uint8_t node = page_frames[frame].node;
+
+	while (order < PAGE_MAX_ORDER) {
+		uint64_t buddy_frame = frame ^ (1UL << order);
+		if (buddy_frame >= num_frames)
+			break;
+
+		struct page *buddy = &page_frames[buddy_frame];
+		if (!(buddy->flags & page_flag_buddy) || buddy->order != order || buddy->node != node)
+			break;
+
+		list_del(&buddy->free);
+		buddy->flags &= ~page_flag_buddy;
+		pool->free_blocks[order]--;
+
+		frame &= ~(1UL << order);
+		order++;
+	}
+
+	struct page *page = &page_frames[frame];
+	page->order = order;
+	page->flags |= page_flag_buddy;
+	list_add_head(&page->free, free_list(pool, frame, order));
+	pool->free_blocks[order]++;
+}
+
+// take a single frame of the given color, or the next color in round robin order
+static struct page *buddy_alloc_colored(struct page_pool *pool, uint32_t color) {
+	if (color != PAGE_COLOR_ANY) {
+		struct list *list = &pool->free_colors[color & (page_colors - 1)];
+		return list_empty(list) ? NULL : free_list_take(pool, list, 0);
+	}
+
+	for (uint32_t i = 0; i < page_colors; i++) {
+		uint32_t next = (pool->next_color + i) & (page_colors - 1);
+		if (list_empty(&pool->free_colors[next]))
+			continue;
+
+		pool->next_color = next + 1;
+		return free_list_take(pool, &pool->free_colors[next], 0);
+	}
+
+	return NULL;
+}
+
+// take a block from the smallest non-empty free list, splitting off the unused halves
+// when splitting for a single frame of a specific color, keep the halves that include it
+static struct page *buddy_alloc(struct page_pool *pool, unsigned int order, uint32_t color) {
+	if (order == 0 && page_colors > 1) {
+		struct page *page = buddy_alloc_colored(pool, color);
+		if (page != NULL) {
+			page->order = 0;
+			return page;
+		}
+	}
+
+	unsigned int current = order;
+	if (order == 0 && page_colors > 1)
+		current = 1;
+	while (current <= PAGE_MAX_ORDER && list_empty(&pool->free_areas[current]))
+		current++;
+
+	if (current > PAGE_MAX_ORDER)
+		return NULL;
+
+	struct page *page = free_list_take(pool, &pool->free_areas[current], current);
+
+	while (current > order) {
+		current--;
+
+		struct page *buddy = page + (1UL << current);
+		if (
+			color != PAGE_COLOR_ANY &&
+			!block_has_color(page - page_frames, current, color) &&
+			block_has_color(buddy - page_frames, current, color)
+		) {
+			struct page *keep = buddy;
+			buddy = page;
+			page = keep;
+		}
+
+		buddy->order = current;
+		buddy->flags |= page_flag_buddy;
+		list_add_head(&buddy->free, free_list(pool, buddy - page_frames, current));
+		pool->free_blocks[current]++;
+	}
+
+	page->order = order;
+	return page;
+}
+
+// allocate from node, falling back on other nodes in order of distance
+static struct page *pool_alloc(uint32_t node, unsigned int order, uint32_t color) {
+	for (uint32_t i = 0; i < numa_node_count; i++) {
+		struct page_pool *pool = &page_pools[numa_fallback[node][i]];
+
+		struct spinlock_node lock_node;
+		spin_lock(&pool->lock, &lock_node);
+		struct page *page = buddy_alloc(pool, order, color);
+		spin_unlock(&pool->lock, &lock_node);
+
+		if (page != NULL)
+			return page;
+	}
+
+	return NULL;
+}
+
+static void pool_free(struct page *page, unsigned int order) {
+	struct page_pool *pool = &page_pools[page->node];
+
+	struct spinlock_node lock_node;
+	spin_lock(&pool->lock, &lock_node);
+	buddy_free(pool, page - page_frames, order);
+	spin_unlock(&pool->lock, &lock_node);
+}
+
+static void page_cache_refill(struct page_cache *cache) {
+	uint32_t node = local_node();
+
+	for (uint32_t i = 0; i < numa_node_count && cache->count == 0; i++) {
+		struct page_pool *pool = &page_pools[numa_fallback[node][i]];
+
+		struct spinlock_node lock_node;
+		spin_lock(&pool->lock, &lock_node);
+
+		for (int n = 0; n < PAGE_CACHE_BATCH; n++) {
+			struct page *page = buddy_alloc(pool, 0, PAGE_COLOR_ANY);
+			if (page == NULL)
+				break;
+
+			list_add_tail(&page->free, &cache->pages);
+			cache->count++;
+		}
+
+		spin_unlock(&pool->lock, &lock_node);
+	}
+}
+
+static void page_cache_drain(struct page_cache *cache, uint32_t count) {
+	struct page_pool *pool = NULL;
+	struct spinlock_node lock_node;
+
+	for (; count > 0 && cache->count > 0; count--) {
+		struct page *page = containerof(cache->pages.prev, struct page, free);
+		list_del(&page->free);
+		cache->count--;
+
+		// frames borrowed from another node during a refill go back to their own pool
+		if (pool != &page_pools[page->node]) {
+			if (pool != NULL)
+				spin_unlock(&pool->lock, &lock_node);
+			pool = &page_pools[page->node];
+			spin_lock(&pool->lock, &lock_node);
+		}
+
+		buddy_free(pool, page - page_frames, 0);
+	}
+
+	if (pool != NULL)
+		spin_unlock(&pool->lock, &lock_node);
+}
+
+static struct page *page_cache_alloc(void) {
+	struct page_cache *cache = SMP_PERCPU_PTR(page_cache);
+	if (cache->count == 0)
+		page_cache_refill(cache);
+	if (cache->count == 0)
+		return NULL;
+
+	struct page *page = containerof(cache->pages.next, struct page, free);
+	list_del(&page->free);
+	cache->count--;
+
+	return page;
+}
+
+static void page_cache_free(struct page *page, bool hot) {
+	struct page_cache *cache = SMP_PERCPU_PTR(page_cache);
+	if (hot)
+		list_add_head(&page->free, &cache->pages);
+	else
+		list_add_tail(&page->free, &cache->pages);
+	cache->count++;
+
+	if (cache->count > PAGE_CACHE_HIGH)
+		page_cache_drain(cache, PAGE_CACHE_BATCH);
+}
+
+// sections initialized before page_alloc_init returns- the rest are initialized in parallel by
+// page_init_deferred, and become allocatable one at a time
+// set this to (uint64_t)-1 to initialize everything up front
+#define PAGE_EAGER_SIZE (1UL << 30)
+
+// populated sections in ascending order
+static uint64_t *sections;
+static uint64_t section_count;
+static uint64_t eager_sections;
+
+// free memory as of page_alloc_init, in frames
+static struct free_range {
+	uint64_t start;
+	uint64_t end;
+} *free_ranges;
+static uint64_t free_range_count;
+
+static bool deferred_ready;
+static uint64_t deferred_next;
+
+// 1G blocks set aside at boot for page_alloc_huge, since the buddy allocator tops out at 4M
+// at most an eighth of ram is set aside
+#define HUGE_RESERVE_MAX 4
+#define HUGE_ORDER (PDPT_SHIFT - PAGE_SHIFT)
+
+static uint64_t huge_blocks[HUGE_RESERVE_MAX];
+static uint32_t huge_block_count;
+
+static struct spinlock huge_lock;
+static struct list huge_free;
+
+// reclaim callbacks for when the pools run dry
+#define SHRINK_BATCH 32
+#define SHRINK_PASSES 4
+
+static struct spinlock shrinker_lock;
+static struct list shrinkers = LIST_INIT(shrinkers);
+
+// collect the sections that contain ram, returning how many there are
+static uint64_t memmap_sections(uint64_t *out) {
+	uint64_t count = 0;
+
+	// regions come in ascending order, so only the last section can be seen twice
+	uint64_t previous = (uint64_t)-1;
+	uint64_t i = 0, start_frame, end_frame;
+	while (memory_pages_next(&i, &start_frame, &end_frame), i != (uint64_t)-1) {
+		uint64_t first = start_frame / SECTION_FRAMES;
+		uint64_t last = (end_frame - 1) / SECTION_FRAMES;
+		for (uint64_t section = first; section <= last; section++) {
+			if (section == previous)
+				continue;
+
+			if (out != NULL)
+				out[count] = section;
+			count++;
+			previous = section;
+		}
 	}
 
+	return count;
+}
+
+// collect whole free frames, returning how many ranges there are
+static uint64_t memory_free_ranges(struct free_range *out) {
+	uint64_t count = 0;
+
 	uint64_t i = 0, found_start, found_end;
 	while (memory_free_next(&i, &found_start, &found_end), i != (uint64_t)-1) {
 		uint64_t page_start = (found_start + PAGE_SIZE - 1) >> PAGE_SHIFT;
 		uint64_t page_end = found_end >> PAGE_SHIFT;
-
 		if (page_start >= page_end)
 			continue;
 
-		for (uint64_t i = page_start; i < page_end; i++) {
-			list_add_tail(&page_frames[i].free, &free_pages);
+		if (out != NULL)
+			out[count] = (struct free_range){ page_start, page_end };
+		count++;
+	}
+
+	return count;
+}
+
+// back one section of the memmap, preferably with memory from the section itself
+// the descriptors are left uninitialized for memmap_init
+static void memmap_populate(uint64_t section) {
+	uint64_t start = section << SECTION_SHIFT;
+	uint64_t end = start + (1UL << SECTION_SHIFT);
+
+	if (start < PAGE_SIZE)
+		start = PAGE_SIZE;
+
+	uint64_t phys = memory_find(start, end, SECTION_MEMMAP_SIZE, PAGE_SIZE);
+	if (phys == 0)
+		phys = memory_find(PAGE_SIZE, memory_end(), SECTION_MEMMAP_SIZE, PAGE_SIZE);
+	assert(phys != 0);
+	memory_reserve(phys, SECTION_MEMMAP_SIZE);
+
+	paging_map(
+		(uint64_t)&page_frames[section * SECTION_FRAMES], phys, SECTION_MEMMAP_SIZE,
+		PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL
+	);
+}
+
+// carve [page_start, page_end) into the largest naturally aligned blocks that fit within a node
+static void free_frames(uint64_t page_start, uint64_t page_end) {
+	while (page_start < page_end) {
+		uint64_t node_end;
+		numa_node_of(page_start << PAGE_SHIFT, &node_end);
+
+		uint64_t block_end = page_end;
+		if (node_end >> PAGE_SHIFT < block_end)
+			block_end = node_end >> PAGE_SHIFT;
+
+		unsigned int order = 0;
+		while (
+			order < PAGE_MAX_ORDER &&
+			(page_start & ((1UL << (order + 1)) - 1)) == 0 &&
+			page_start + (1UL << (order + 1)) <= block_end
+		)
+			order++;
+
+		for (uint64_t frame = page_start; frame < page_start + (1UL << order); frame++)
+			page_frames[frame].ref_count = 0;
+
+		pool_free(&page_frames[page_start], order);
+		atomic_fetch_add_explicit(&managed_frames, 1UL << order, memory_order_relaxed);
+		page_start += 1UL << order;
+	}
+}
+
+// initialize a section's descriptors and hand its free frames to the pools
+static void memmap_init(uint64_t section) {
+	uint64_t section_start = section * SECTION_FRAMES;
+	uint64_t section_end = section_start + SECTION_FRAMES;
+
+	uint32_t node = 0;
+	uint64_t node_end = 0;
+	for (uint64_t i = section_start; i < section_end; i++) {
+		if (i << PAGE_SHIFT >= node_end)
+			node = numa_node_of(i << PAGE_SHIFT, &node_end);
+
+		page_frames[i] = (struct page){ .ref_count = 1, .node = node };
+		list_init(&page_frames[i].free);
+	}
+
+	for (uint64_t i = 0; i < free_range_count; i++) {
+		uint64_t page_start = free_ranges[i].start;
+		uint64_t page_end = free_ranges[i].end;
+		if (page_end <= section_start || page_start >= section_end)
+			continue;
+
+		if (page_start < section_start)
+			page_start = section_start;
+		if (page_end > section_end)
+			page_end = section_end;
+
+		free_frames(page_start, page_end);
+	}
+}
+
+// zeroed frames are the cheapest memory to give back
+static uint64_t zero_pool_shrink(struct shrinker *shrinker, uint64_t count) {
+	uint64_t freed = 0;
+	for (uint32_t i = 0; i < numa_node_count && freed < count; i++) {
+		struct zero_pool *pool = &zero_pools[i];
+
+		struct spinlock_node node;
+		spin_lock(&pool->lock, &node);
+
+		struct list pages = LIST_INIT(pages);
+		for (; freed < count && !list_empty(&pool->pages); freed++) {
+			struct list *entry = pool->pages.prev;
+			list_del(entry);
+			list_add_head(entry, &pages);
+			pool->count--;
+		}
+
+		// don't immediately refill the pool under pressure
+		pool->refilling = false;
+		spin_unlock(&pool->lock, &node);
+
+		while (!list_empty(&pages)) {
+			struct page *page = containerof(pages.next, struct page, free);
+			list_del(&page->free);
+			page_free(page);
 		}
 	}
+
+	return freed;
+}
+
+static struct shrinker zero_pool_shrinker = {
+	.priority = 0,
+	.shrink = zero_pool_shrink,
+};
+
+// set aside naturally aligned 1G blocks before anything else can fragment them
+static void huge_reserve(void) {
+	uint64_t total = 0;
+	uint64_t i = 0, start_frame, end_frame;
+	while (memory_pages_next(&i, &start_frame, &end_frame), i != (uint64_t)-1)
+		total += (end_frame - start_frame) << PAGE_SHIFT;
+
+	while (huge_block_count < HUGE_RESERVE_MAX && (huge_block_count + 1) * PDPT_SIZE <= total / 8) {
+		uint64_t phys = memory_find(PDPT_SIZE, memory_end(), PDPT_SIZE, PDPT_SIZE);
+		if (phys == 0)
+			break;
+
+		memory_reserve(phys, PDPT_SIZE);
+		huge_blocks[huge_block_count++] = phys;
+
+		kprintf("page: huge block [%#015lx-%#015lx)\n", phys, phys + PDPT_SIZE);
+	}
+}
+
+static bool huge_section(uint64_t section) {
+	for (uint32_t i = 0; i < huge_block_count; i++) {
+		uint64_t first = huge_blocks[i] >> SECTION_SHIFT;
+		uint64_t last = (huge_blocks[i] + PDPT_SIZE - 1) >> SECTION_SHIFT;
+		if (first <= section && section <= last)
+			return true;
+	}
+
+	return false;
+}
+
+// largest number of pages in one way of a data or unified cache described by a cpuid leaf
+static uint32_t cache_way_pages(uint32_t leaf) {
+	uint32_t pages = 1;
+	for (uint32_t i = 0; i < 16; i++) {
+		uint32_t eax, ebx, ecx, edx;
+		cpuid_count(leaf, i, &eax, &ebx, &ecx, &edx);
+
+		uint32_t type = eax & 0x1f;
+		if (type == 0)
+			break;
+		if (type == 2)
+			continue;
+
+		uint32_t line = (ebx & 0xfff) + 1;
+		uint32_t partitions = ((ebx >> 12) & 0x3ff) + 1;
+		uint32_t sets = ecx + 1;
+
+		uint32_t way_pages = line * partitions * sets / PAGE_SIZE;
+		if (way_pages > pages)
+			pages = way_pages;
+	}
+
+	return pages;
+}
+
+// number of page colors in the last level cache, or 1 with coloring off
+uint32_t page_color_count(void) {
+	if (!PAGE_COLORING)
+		return 1;
+
+	uint32_t eax, ebx, ecx, edx;
+	uint32_t colors = 1;
+
+	// intel deterministic cache parameters, then the amd equivalent
+	cpuid(0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 4)
+		colors = cache_way_pages(4);
+	if (colors == 1) {
+		cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+		if (eax >= 0x8000001d)
+			colors = cache_way_pages(0x8000001d);
+	}
+
+	while (colors & (colors - 1))
+		colors &= colors - 1;
+	if (colors > PAGE_COLORS_MAX)
+		colors = PAGE_COLORS_MAX;
+
+	return colors;
+}
+
+void page_alloc_init(void) {
+	num_frames = memory_end() >> PAGE_SHIFT;
+
+	page_colors = page_color_count();
+	if (page_colors > 1)
+		kprintf("page: %u colors\n", page_colors);
+
+	huge_reserve();
+
+	for (uint32_t node = 0; node < numa_node_count; node++) {
+		for (unsigned int order = 0; order <= PAGE_MAX_ORDER; order++)
+			list_init(&page_pools[node].free_areas[order]);
+		for (uint32_t color = 0; color < page_colors; color++)
+			list_init(&page_pools[node].free_colors[color]);
+	}
+
+	for (unsigned int cpu = 0; cpu < lapic_count; cpu++)
+		list_init(&SMP_PERCPU_SYM(cpu, page_cache).pages);
+
+	for (uint32_t node = 0; node < numa_node_count; node++) {
+		list_init(&zero_pools[node].pages);
+		zero_pools[node].refilling = true;
+	}
+
+	shrinker_register(&zero_pool_shrinker);
+
+	uint64_t j = 0, start_frame, end_frame;
+	while (memory_pages_next(&j, &start_frame, &end_frame), j != (uint64_t)-1)
+		total_frames += end_frame - start_frame;
+
+	section_count = memmap_sections(NULL);
+	sections = memory_alloc(
+		PAGE_SIZE, memory_end(), section_count * sizeof(*sections), alignof(*sections)
+	);
+	memmap_sections(sections);
+
+	for (uint64_t i = 0; i < section_count; i++)
+		memmap_populate(sections[i]);
+
+	// reserving the array itself may split one more range in two
+	free_range_count = memory_free_ranges(NULL) + 1;
+	free_ranges = memory_alloc(
+		PAGE_SIZE, memory_end(), free_range_count * sizeof(*free_ranges), alignof(*free_ranges)
+	);
+	free_range_count = memory_free_ranges(free_ranges);
+
+	uint64_t eager_limit = PAGE_EAGER_SIZE >> SECTION_SHIFT;
+	if (eager_limit == 0)
+		eager_limit = 1;
+
+	// sections holding huge blocks are always eager, so page_alloc_huge never races
+	// with page_init_deferred over their descriptors
+	eager_sections = 0;
+	for (uint64_t i = 0; i < section_count; i++) {
+		if (i >= eager_limit && !huge_section(sections[i]))
+			continue;
+
+		uint64_t section = sections[i];
+		sections[i] = sections[eager_sections];
+		sections[eager_sections++] = section;
+	}
+
+	for (uint64_t i = 0; i < eager_sections; i++)
+		memmap_init(sections[i]);
+
+	list_init(&huge_free);
+	for (uint32_t i = 0; i < huge_block_count; i++) {
+		struct page *page = &page_frames[huge_blocks[i] >> PAGE_SHIFT];
+		page->ref_count = 0;
+		page->order = HUGE_ORDER;
+		list_add_tail(&page->free, &huge_free);
+	}
+
+	deferred_next = eager_sections;
+	atomic_store_explicit(&deferred_ready, true, memory_order_release);
+}
+
+// whether page_alloc can be used yet, rather than carving memory out of the boot memory map
+bool page_alloc_ready(void) {
+	return atomic_load_explicit(&deferred_ready, memory_order_acquire);
+}
+
+// initialize the remaining sections in parallel, called by every cpu once it is otherwise idle
+void page_init_deferred(void) {
+	while (!atomic_load_explicit(&deferred_ready, memory_order_acquire))
+		__asm__ volatile ("pause");
+
+	while (true) {
+		uint64_t i = atomic_fetch_add_explicit(&deferred_next, 1, memory_order_relaxed);
+		if (i >= section_count)
+			break;
+
+		memmap_init(sections[i]);
+	}
+}
+
+static bool section_eager(uint64_t section) {
+	for (uint64_t i = 0; i < eager_sections; i++) {
+		if (sections[i] == section)
+			return true;
+	}
+
+	return false;
+}
+
+// hand memory that was reserved at boot over to the pools, e.g. once startup code is done with it
+// partial pages at either end are left alone
+void page_free_range(uint64_t phys, uint64_t size) {
+	uint64_t page_start = round_up(phys, PAGE_SIZE) >> PAGE_SHIFT;
+	uint64_t page_end = round_down(phys + size, PAGE_SIZE) >> PAGE_SHIFT;
+	if (page_start >= page_end)
+		return;
+
+	// the descriptors must already be initialized, or memmap_init would clobber the freed frames
+	assert(section_eager(page_start / SECTION_FRAMES));
+	assert(section_eager((page_end - 1) / SECTION_FRAMES));
+
+	free_frames(page_start, page_end);
 }
 
 struct page *page_alloc() {
-	// TODO: free up cache space on OOM
-	if (list_empty(&free_pages))
+	return page_alloc_node(local_node(), 0);
+}
+
+// allocate 2^order physically contiguous pages, aligned to their size
+struct page *page_alloc_order(unsigned int order) {
+	return page_alloc_node(local_node(), order);
+}
+
+// allocate without falling back on reclaim
+// every frame leaving the pools is counted here, so frames that pass through the zero pool are
+// counted once, when they're taken to be cleared
+static struct page *page_alloc_fast(uint32_t node, unsigned int order) {
+	struct page *page;
+	if (order == 0 && node == local_node())
+		page = page_cache_alloc();
+	else
+		page = pool_alloc(node, order, PAGE_COLOR_ANY);
+	if (page == NULL)
 		return NULL;
 
-	struct page *page = containerof(free_pages.next, struct page, free);
-	list_del(&page->free);
+	page->order = order;
+	atomic_store_explicit(&page->ref_count, 1, memory_order_relaxed);
 
-	page->ref_count++;
+	struct page_cpu_stats *stats = SMP_PERCPU_PTR(page_cpu_stats);
+	stats->alloc[order]++;
+	stats->alloc_node[page->node] += 1UL << order;
 	return page;
 }
 
+// allocate from a specific node first, then from the nodes closest to it
+struct page *page_alloc_node(uint32_t node, unsigned int order) {
+	assert(order <= PAGE_MAX_ORDER);
+	assert(node < numa_node_count);
+
+	struct page *page = page_alloc_fast(node, order);
+
+	// ask the shrinkers for progressively more memory before giving up
+	for (int pass = 0; page == NULL && pass < SHRINK_PASSES; pass++) {
+		if (shrink_memory((SHRINK_BATCH << pass) << order) == 0)
+			break;
+
+		page = page_alloc_fast(node, order);
+	}
+
+	if (page == NULL)
+		SMP_PERCPU_PTR(page_cpu_stats)->fail[order]++;
+	return page;
+}
+
+// shrinkers are called in order of priority, lowest first
+void shrinker_register(struct shrinker *shrinker) {
+	struct spinlock_node node;
+	spin_lock(&shrinker_lock, &node);
+
+	struct list *entry = shrinkers.next;
+	for (; entry != &shrinkers; entry = entry->next) {
+		if (containerof(entry, struct shrinker, list)->priority > shrinker->priority)
+			break;
+	}
+	list_add_tail(&shrinker->list, entry);
+
+	spin_unlock(&shrinker_lock, &node);
+}
+
+void shrinker_unregister(struct shrinker *shrinker) {
+	struct spinlock_node node;
+	spin_lock(&shrinker_lock, &node);
+	list_del(&shrinker->list);
+	spin_unlock(&shrinker_lock, &node);
+}
+
+// reclaim up to count pages, asking each shrinker for at most SHRINK_BATCH pages at a time
+// shrinkers must not allocate memory themselves
+uint64_t shrink_memory(uint64_t count) {
+	uint64_t freed = 0;
+
+	struct spinlock_node node;
+	spin_lock(&shrinker_lock, &node);
+
+	for (struct list *entry = shrinkers.next; entry != &shrinkers && freed < count; ) {
+		struct shrinker *shrinker = containerof(entry, struct shrinker, list);
+
+		uint64_t batch = count - freed;
+		if (batch > SHRINK_BATCH)
+			batch = SHRINK_BATCH;
+
+		// keep asking the same shrinker until it comes up short
+		uint64_t shrunk = shrinker->shrink(shrinker, batch);
+		freed += shrunk;
+		if (shrunk < batch)
+			entry = entry->next;
+	}
+
+	spin_unlock(&shrinker_lock, &node);
+	return freed;
+}
+
+static void page_release(struct page *page, unsigned int order, bool hot) {
+	assert(page->order == order);
+
+	if (atomic_fetch_sub_explicit(&page->ref_count, 1, memory_order_acq_rel) != 1)
+		return;
+
+	SMP_PERCPU_PTR(page_cpu_stats)->free[order]++;
+
+	// only cache local frames, so remote ones aren't handed out to local allocations
+	if (order == 0 && page->node == local_node())
+		page_cache_free(page, hot);
+	else
+		pool_free(page, order);
+}
+
 void page_free(struct page *page) {
-	page->ref_count--;
-	if (page->ref_count == 0) {
-		list_add_head(&page->free, &free_pages);
+	page_release(page, 0, true);
+}
+
+// free a frame that is not expected to be in cache, so it gets reused last
+void page_free_cold(struct page *page) {
+	page_release(page, 0, false);
+}
+
+void page_free_order(struct page *page, unsigned int order) {
+	page_release(page, order, true);
+}
+
+// allocate a single frame, preferably of the given cache color
+struct page *page_alloc_color(uint32_t color) {
+	if (page_colors == 1)
+		return page_alloc();
+
+	color &= page_colors - 1;
+
+	// the local cache may already have one
+	struct page_cache *cache = SMP_PERCPU_PTR(page_cache);
+	struct page *page = NULL;
+	for (struct list *entry = cache->pages.next; entry != &cache->pages; entry = entry->next) {
+		struct page *cached = containerof(entry, struct page, free);
+		if (((cached - page_frames) & (page_colors - 1)) != color)
+			continue;
+
+		list_del(&cached->free);
+		cache->count--;
+		page = cached;
+		break;
+	}
+
+	if (page == NULL)
+		page = pool_alloc(local_node(), 0, color);
+
+	// settle for any color, with the usual reclaim
+	if (page == NULL)
+		return page_alloc();
+
+	page->order = 0;
+	atomic_store_explicit(&page->ref_count, 1, memory_order_relaxed);
+
+	struct page_cpu_stats *stats = SMP_PERCPU_PTR(page_cpu_stats);
+	stats->alloc[0]++;
+	stats->alloc_node[page->node]++;
+	return page;
+}
+
+// allocate a naturally aligned block that fits a single large page at level (1 = 2M, 2 = 1G)
+// 1G blocks come from the boot-time reservation, and the direct map covers them with 1G pages
+struct page *page_alloc_huge(unsigned int level) {
+	if (level == 1)
+		return page_alloc_order(PD_SHIFT - PAGE_SHIFT);
+
+	assert(level == 2);
+
+	struct page *page = NULL;
+	struct spinlock_node node;
+	spin_lock(&huge_lock, &node);
+	if (!list_empty(&huge_free)) {
+		page = containerof(huge_free.next, struct page, free);
+		list_del(&page->free);
+	}
+	spin_unlock(&huge_lock, &node);
+
+	struct page_cpu_stats *stats = SMP_PERCPU_PTR(page_cpu_stats);
+	if (page == NULL) {
+		stats->huge_fail++;
+		return NULL;
+	}
+
+	atomic_store_explicit(&page->ref_count, 1, memory_order_relaxed);
+	stats->huge_alloc++;
+	stats->alloc_node[page->node] += 1UL << HUGE_ORDER;
+	return page;
+}
+
+void page_free_huge(struct page *page, unsigned int level) {
+	if (level == 1) {
+		page_free_order(page, PD_SHIFT - PAGE_SHIFT);
+		return;
+	}
+
+	assert(level == 2 && page->order == HUGE_ORDER);
+
+	if (atomic_fetch_sub_explicit(&page->ref_count, 1, memory_order_acq_rel) != 1)
+		return;
+
+	SMP_PERCPU_PTR(page_cpu_stats)->huge_free++;
+
+	struct spinlock_node node;
+	spin_lock(&huge_lock, &node);
+	list_add_head(&page->free, &huge_free);
+	spin_unlock(&huge_lock, &node);
+}
+
+// clear a frame without pulling it into the cache
+static void page_clear_nt(void *address) {
+	uint64_t *p = address;
+	for (size_t i = 0; i < PAGE_SIZE / sizeof(*p); i++)
+		__asm__ volatile ("movnti %1, %0" : "=m"(p[i]) : "r"(0UL));
+
+	__asm__ volatile ("sfence" ::: "memory");
+}
+
+// allocate a frame filled with zeroes, preferably one cleared ahead of time
+struct page *page_alloc_zeroed(void) {
+	struct zero_pool *pool = &zero_pools[local_node()];
+
+	struct page *page = NULL;
+	struct spinlock_node node;
+	spin_lock(&pool->lock, &node);
+	if (!list_empty(&pool->pages)) {
+		page = containerof(pool->pages.next, struct page, free);
+		list_del(&page->free);
+		pool->count--;
+	}
+	bool wake = !pool->refilling && pool->count < ZERO_POOL_LOW;
+	if (wake)
+		pool->refilling = true;
+	spin_unlock(&pool->lock, &node);
+
+	// only the first allocation below the watermark wakes a cpu- the rest would find it busy
+	if (wake)
+		smp_wake_node(local_node());
+
+	if (page != NULL)
+		return page;
+
+	// the caller is about to use this frame, so clear it through the cache
+	page = page_alloc();
+	if (page != NULL)
+		memset(page_address(page), 0, PAGE_SIZE);
+	return page;
+}
+
+// top up the local node's zeroed frames, returning false if there was nothing to do
+bool page_zero_idle(void) {
+	struct zero_pool *pool = &zero_pools[local_node()];
+	if (!atomic_load_explicit(&pool->refilling, memory_order_relaxed))
+		return false;
+
+	struct page *pages[ZERO_POOL_BATCH];
+	int count = 0;
+	for (; count < ZERO_POOL_BATCH; count++) {
+		pages[count] = page_alloc_fast(local_node(), 0);
+		if (pages[count] == NULL)
+			break;
+
+		page_clear_nt(page_address(pages[count]));
+	}
+
+	struct spinlock_node node;
+	spin_lock(&pool->lock, &node);
+	for (int i = 0; i < count; i++) {
+		list_add_tail(&pages[i]->free, &pool->pages);
+		pool->count++;
+	}
+	if (count < ZERO_POOL_BATCH || pool->count >= ZERO_POOL_HIGH)
+		pool->refilling = false;
+	spin_unlock(&pool->lock, &node);
+
+	return count > 0;
+}
+
+void page_stats_cpu(uint32_t cpu, struct page_cpu_stats *out) {
+	*out = SMP_PERCPU_SYM(cpu, page_cpu_stats);
+	out->cached = SMP_PERCPU_SYM(cpu, page_cache).count;
+}
+
+// free list lengths are read without the pool lock, so they are only a snapshot
+void page_stats_node(uint32_t node, struct page_node_stats *out) {
+	struct page_pool *pool = &page_pools[node];
+
+	out->free = 0;
+	for (unsigned int order = 0; order <= PAGE_MAX_ORDER; order++) {
+		out->free_blocks[order] = pool->free_blocks[order];
+		out->free += pool->free_blocks[order] << order;
+	}
+
+	// unusable free space index: the fraction of free memory in blocks too small for an order
+	uint64_t usable = out->free;
+	for (unsigned int order = 0; order <= PAGE_MAX_ORDER; order++) {
+		out->fragmentation[order] = out->free == 0 ? 0 : (out->free - usable) * 1000 / out->free;
+		usable -= out->free_blocks[order] << order;
+	}
+
+	out->zeroed = zero_pools[node].count;
+}
+
+void page_stats(struct page_stats *out) {
+	out->total = total_frames;
+	out->managed = atomic_load_explicit(&managed_frames, memory_order_relaxed);
+	out->free = 0;
+	out->slab = 0;
+
+	for (uint32_t node = 0; node < numa_node_count; node++) {
+		struct page_node_stats node_stats;
+		page_stats_node(node, &node_stats);
+		out->free += node_stats.free + node_stats.zeroed;
+	}
+
+	for (uint32_t cpu = 0; cpu < lapic_count; cpu++) {
+		out->free += SMP_PERCPU_SYM(cpu, page_cache).count;
+		out->slab += SMP_PERCPU_SYM(cpu, page_cpu_stats).slab;
+	}
+}
+
+// called by the slab layer as it takes and gives back frames
+void page_stats_slab(int64_t frames) {
+	SMP_PERCPU_PTR(page_cpu_stats)->slab += frames;
+}
+
+void page_stats_dump(void) {
+	struct page_stats stats;
+	page_stats(&stats);
+
+	kprintf(
+		"page: %lu frames, %lu reserved, %lu free, %ld in slabs\n",
+		stats.total, stats.total - stats.managed, stats.free, stats.slab
+	);
+
+	for (uint32_t node = 0; node < numa_node_count; node++) {
+		struct page_node_stats node_stats;
+		page_stats_node(node, &node_stats);
+
+		kprintf(" node %u: %lu free, %lu zeroed\n", node, node_stats.free, node_stats.zeroed);
+		kprintf("  order      blocks frag\n");
+		for (unsigned int order = 0; order <= PAGE_MAX_ORDER; order++) {
+			kprintf(
+				"  %5u %11lu %u.%03u\n", order, node_stats.free_blocks[order],
+				node_stats.fragmentation[order] / 1000, node_stats.fragmentation[order] % 1000
+			);
+		}
+	}
+
+	for (uint32_t cpu = 0; cpu < lapic_count; cpu++) {
+		struct page_cpu_stats cpu_stats;
+		page_stats_cpu(cpu, &cpu_stats);
+
+		kprintf(" cpu %u: %u cached\n", cpu, cpu_stats.cached);
+		kprintf("  order       alloc        free        fail\n");
+		for (unsigned int order = 0; order <= PAGE_MAX_ORDER; order++) {
+			uint64_t events = cpu_stats.alloc[order] + cpu_stats.free[order] + cpu_stats.fail[order];
+			if (events == 0)
+				continue;
+
+			kprintf(
+				"  %5u %11lu %11lu %11lu\n", order,
+				cpu_stats.alloc[order], cpu_stats.free[order], cpu_stats.fail[order]
+			);
+		}
+
+		if (cpu_stats.huge_alloc + cpu_stats.huge_free + cpu_stats.huge_fail != 0) {
+			kprintf(
+				"  1G    %11lu %11lu %11lu\n",
+				cpu_stats.huge_alloc, cpu_stats.huge_free, cpu_stats.huge_fail
+			);
+		}
+
+		for (uint32_t node = 0; node < numa_node_count; node++)
+			kprintf("  node %u: %lu frames allocated\n", node, cpu_stats.alloc_node[node]);
 	}
 }
 
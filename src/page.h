@@ -1,5 +1,10 @@
 #include "list.h"
+#include "numa.h"
 #include <stdint.h>
+#include <stdbool.h>
+
+// blocks of up to 2^PAGE_MAX_ORDER pages (4M)
+#define PAGE_MAX_ORDER 10
 
 struct page {
 	union {
@@ -12,12 +17,98 @@ struct page {
 	};
 
 	uint32_t ref_count;
+	uint8_t order;
+	uint8_t flags;
+	uint8_t node;
+};
+
+#define PAGE_COLOR_ANY ((uint32_t)-1)
+
+enum page_flags {
+	// head of a free block on one of the buddy free lists
+	page_flag_buddy = 1 << 0,
+
+	// head of a block handed out directly by kmalloc
+	page_flag_kmalloc = 1 << 1,
+};
+
+// a reclaim callback for page_alloc to call before it fails
+struct shrinker {
+	struct list list;
+
+	// lower priorities are asked first
+	int priority;
+
+	// free up to count pages, returning how many were actually freed
+	uint64_t (*shrink)(struct shrinker *shrinker, uint64_t count);
+};
+
+// counters kept by each cpu without locking
+struct page_cpu_stats {
+	uint64_t alloc[PAGE_MAX_ORDER + 1];
+	uint64_t free[PAGE_MAX_ORDER + 1];
+	uint64_t fail[PAGE_MAX_ORDER + 1];
+
+	// 1G blocks from the set-aside pool, which are beyond PAGE_MAX_ORDER
+	uint64_t huge_alloc;
+	uint64_t huge_free;
+	uint64_t huge_fail;
+
+	// frames allocated from each node
+	uint64_t alloc_node[NUMA_MAX_NODES];
+
+	// net frames taken by the slab layer on this cpu, which may be negative
+	int64_t slab;
+
+	// length of the per-cpu frame cache
+	uint32_t cached;
+};
+
+struct page_node_stats {
+	uint64_t free;
+	uint64_t zeroed;
+	uint64_t free_blocks[PAGE_MAX_ORDER + 1];
+
+	// per-mille of free memory that can't satisfy an allocation of each order
+	uint32_t fragmentation[PAGE_MAX_ORDER + 1];
+};
+
+// in frames
+struct page_stats {
+	uint64_t total;
+	uint64_t managed;
+	uint64_t free;
+	int64_t slab;
 };
 
 void page_alloc_init(void);
+void page_init_deferred(void);
+bool page_alloc_ready(void);
 
 struct page *page_alloc();
+struct page *page_alloc_order(unsigned int order);
+struct page *page_alloc_node(uint32_t node, unsigned int order);
+struct page *page_alloc_color(uint32_t color);
+struct page *page_alloc_zeroed(void);
+struct page *page_alloc_huge(unsigned int level);
 void page_free(struct page *page);
+void page_free_cold(struct page *page);
+void page_free_order(struct page *page, unsigned int order);
+void page_free_huge(struct page *page, unsigned int level);
+void page_free_range(uint64_t phys, uint64_t size);
+
+bool page_zero_idle(void);
+uint32_t page_color_count(void);
+
+void page_stats(struct page_stats *out);
+void page_stats_node(uint32_t node, struct page_node_stats *out);
+void page_stats_cpu(uint32_t cpu, struct page_cpu_stats *out);
+void page_stats_slab(int64_t frames);
+void page_stats_dump(void);
+
+void shrinker_register(struct shrinker *shrinker);
+void shrinker_unregister(struct shrinker *shrinker);
+uint64_t shrink_memory(uint64_t count);
 
 void *page_address(struct page *page);
 struct page *page_from_address(void *address);
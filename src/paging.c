@@ -1,8 +1,13 @@
 #include "memory.h"
+#include "page.h"
+#include "vmap.h"
+#include "smp.h"
+#include "cpu.h"
 #include <paging.h>
 #include <efi.h>
 #include <kprintf.h>
 #include <string.h>
+#include <assert.h>
 #include <stdint.h>
 #include <stddef.h>
 
@@ -89,17 +94,10 @@ static int split_range(struct range ranges[5], uint64_t start, uint64_t end) {
 	return range;
 }
 
-// reserve 2 page tables to get started
-// TODO: how many do we really need, given the boostrap direct mapping?
-static uint64_t init_page_tables[2][PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
-static unsigned int init_page_table = 0;
-
-static uint64_t mapped_top = 0;
+// startup.S already maps the first 1G of the direct map, so page tables can come from there
+static uint64_t mapped_top = PDPT_SIZE;
 
 static void *alloc_page_direct() {
-	if (init_page_table < sizeof(init_page_tables) / sizeof(*init_page_tables))
-		return VIRT_DIRECT(PHYS_KERNEL(init_page_tables[init_page_table++]));
-
 	// TODO: what to do about the bottom page?
 	void *page = memory_alloc(PAGE_SIZE, mapped_top, PAGE_SIZE, PAGE_SIZE);
 
@@ -187,7 +185,8 @@ static void direct_map_pml4(uint64_t start_phys, uint64_t end_phys, uint8_t leve
 	}
 
 	write_cr3(PHYS_KERNEL(kernel_pml4));
-	mapped_top = end_phys;
+	if (mapped_top < end_phys)
+		mapped_top = end_phys;
 }
 
 // TODO: unmap memory in the first GB that's hard-coded in startup.S
@@ -201,17 +200,247 @@ void direct_map(uint64_t start_phys, uint64_t end_phys) {
 		direct_map_pml4(ranges[i].start, ranges[i].end, ranges[i].level);
 }
 
-void paging_init(void *map_address, size_t map_size, size_t desc_size) {
-	// TODO: factor out temporary mappings
-	extern uint64_t kernel_pml4[], pt_map[];
-	for (unsigned int i = 0; i < (map_size + PAGE_SIZE) / PAGE_SIZE; i++) {
-		uint64_t address = ((uint64_t)map_address & PAGE_MASK) + i * PAGE_SIZE;
-		pt_map[2 + i] = address | PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL;
+// page tables come from the boot memory map until the page allocator takes it over
+static void *alloc_table(void) {
+	if (!page_alloc_ready())
+		return alloc_page_direct();
+
+	struct page *page = page_alloc_zeroed();
+	assert(page != NULL);
+	return page_address(page);
+}
+
+static uint64_t *next_table(uint64_t *table, uint64_t index) {
+	assert((table[index] & PAGE_LARGE) == 0);
+
+	if (table[index] == 0) {
+		uint64_t *next = alloc_table();
+		table[index] = PHYS_DIRECT(next) | PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL;
 	}
-	write_cr3(PHYS_KERNEL(kernel_pml4));
-	struct efi_memory_descriptor *memory_map = (struct efi_memory_descriptor*)(
-		0xffffffffc0002000 + ((uint64_t)map_address & ~PAGE_MASK)
-	);
+
+	return VIRT_DIRECT(table[index] & PAGE_MASK);
+}
+
+// whether [virt, virt + size) can start with a single page of page_size mapping phys
+static bool page_fits(uint64_t virt, uint64_t phys, uint64_t size, uint64_t page_size) {
+	return ((virt | phys) & (page_size - 1)) == 0 && size >= page_size;
+}
+
+// move flags for a 4k page to a large page, where the pat bit is taken by PAGE_LARGE
+static uint64_t large_flags(uint64_t flags) {
+	if (flags & PAGE_PAT)
+		flags = (flags & ~PAGE_PAT) | PAGE_PAT_LARGE;
+
+	return flags | PAGE_LARGE;
+}
+
+// map [virt, virt + size) to [phys, phys + size) with the largest pages alignment allows,
+// creating page tables as needed
+// the range must not be mapped yet, so there is nothing to flush from the tlb
+void paging_map(uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags) {
+	uint64_t offset = 0;
+	while (offset < size) {
+		uint64_t address = virt + offset;
+		uint64_t target = phys + offset;
+		uint64_t remaining = size - offset;
+
+		uint64_t *pdpt = next_table(kernel_pml4, PML4_INDEX(address));
+		if (page_fits(address, target, remaining, PDPT_SIZE) && pdpt[PDPT_INDEX(address)] == 0) {
+			pdpt[PDPT_INDEX(address)] = target | large_flags(flags);
+			offset += PDPT_SIZE;
+			continue;
+		}
+
+		uint64_t *pd = next_table(pdpt, PDPT_INDEX(address));
+		if (page_fits(address, target, remaining, PD_SIZE) && pd[PD_INDEX(address)] == 0) {
+			pd[PD_INDEX(address)] = target | large_flags(flags);
+			offset += PD_SIZE;
+			continue;
+		}
+
+		uint64_t *pt = next_table(pd, PD_INDEX(address));
+		pt[PAGE_INDEX(address)] = target | flags;
+		offset += PAGE_SIZE;
+	}
+}
+
+// replace a large page with a table of pages one level down that map the same memory
+static void split_large(uint64_t *entry, uint64_t page_size) {
+	uint64_t large = *entry;
+	uint64_t *table = alloc_table();
+
+	uint64_t flags = large & (~PAGE_MASK | PAGE_PAT_LARGE);
+	uint64_t next_size = page_size / PAGE_ENTRIES;
+	if (next_size == PAGE_SIZE) {
+		flags &= ~(PAGE_LARGE | PAGE_PAT_LARGE);
+		if (large & PAGE_PAT_LARGE)
+			flags |= PAGE_PAT;
+	}
+
+	for (uint64_t i = 0; i < PAGE_ENTRIES; i++)
+		table[i] = ((large & ~(page_size - 1) & PAGE_MASK) + i * next_size) | flags;
+	*entry = PHYS_DIRECT(table) | PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL;
+}
+
+// rewrite an entry for unmapping or for a new memory type
+static uint64_t update_entry(uint64_t entry, bool large, bool unmap, uint64_t cache) {
+	if (unmap)
+		return 0;
+
+	if (large)
+		return (entry & ~(PAGE_PCD | PAGE_PWT | PAGE_PAT_LARGE)) | (large_flags(cache) & ~PAGE_LARGE);
+
+	return (entry & ~PAGE_CACHE_MASK) | cache;
+}
+
+// walk the mappings of [virt, virt + size), splitting any large pages that straddle the ends
+// with flush, only the local tlb drops the affected entries, which is enough for ranges no other cpu
+// has used- anything else, e.g. the direct map, needs smp_flush_all instead
+// without flush, the caller must flush before the addresses are reused
+static void paging_update(uint64_t virt, uint64_t size, bool unmap, uint64_t cache, bool flush) {
+	uint64_t address = virt;
+	while (address < virt + size) {
+		uint64_t remaining = virt + size - address;
+
+		uint64_t *pdpt = VIRT_DIRECT(kernel_pml4[PML4_INDEX(address)] & PAGE_MASK);
+		uint64_t *pdpte = &pdpt[PDPT_INDEX(address)];
+		if (*pdpte & PAGE_LARGE) {
+			if (page_fits(address, 0, remaining, PDPT_SIZE)) {
+				*pdpte = update_entry(*pdpte, true, unmap, cache);
+				if (flush)
+					__asm__ volatile ("invlpg (%0)" :: "r"(address) : "memory");
+				address += PDPT_SIZE;
+				continue;
+			}
+
+			split_large(pdpte, PDPT_SIZE);
+		}
+
+		uint64_t *pd = VIRT_DIRECT(*pdpte & PAGE_MASK);
+		uint64_t *pde = &pd[PD_INDEX(address)];
+		if (*pde & PAGE_LARGE) {
+			if (page_fits(address, 0, remaining, PD_SIZE)) {
+				*pde = update_entry(*pde, true, unmap, cache);
+				if (flush)
+					__asm__ volatile ("invlpg (%0)" :: "r"(address) : "memory");
+				address += PD_SIZE;
+				continue;
+			}
+
+			split_large(pde, PD_SIZE);
+		}
+
+		uint64_t *pt = VIRT_DIRECT(*pde & PAGE_MASK);
+		pt[PAGE_INDEX(address)] = update_entry(pt[PAGE_INDEX(address)], false, unmap, cache);
+		if (flush)
+			__asm__ volatile ("invlpg (%0)" :: "r"(address) : "memory");
+		address += PAGE_SIZE;
+	}
+}
+
+void paging_unmap(uint64_t virt, uint64_t size) {
+	paging_update(virt, size, true, 0, true);
+}
+
+// unmap without flushing the tlb, so a batch of ranges can share a single smp_flush_all
+void paging_unmap_lazy(uint64_t virt, uint64_t size) {
+	paging_update(virt, size, true, 0, false);
+}
+
+#define CR4_PGE (1 << 7)
+
+// flush the whole local tlb, including global pages, which reloading cr3 leaves alone
+void paging_flush_all(void) {
+	uint64_t cr4;
+	__asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+	__asm__ volatile ("mov %0, %%cr4" :: "r"(cr4 & ~CR4_PGE) : "memory");
+	__asm__ volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+// past this many pages, flushing the whole tlb is cheaper than invalidating them one by one
+#define FLUSH_RANGE_MAX 32
+
+// flush the pages of [virt, virt + size) from the local tlb, global pages included
+void paging_flush_range(uint64_t virt, uint64_t size) {
+	if (size > FLUSH_RANGE_MAX * PAGE_SIZE) {
+		paging_flush_all();
+		return;
+	}
+
+	// in offsets, since the range may end at the top of the address space
+	for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE)
+		__asm__ volatile ("invlpg (%0)" :: "r"(virt + offset) : "memory");
+}
+
+// the physical address virt is mapped to, or (uint64_t)-1 if it isn't mapped
+uint64_t paging_translate(uint64_t virt) {
+	uint64_t pml4e = kernel_pml4[PML4_INDEX(virt)];
+	if ((pml4e & PAGE_PRESENT) == 0)
+		return (uint64_t)-1;
+
+	uint64_t pdpte = ((uint64_t*)VIRT_DIRECT(pml4e & PAGE_MASK))[PDPT_INDEX(virt)];
+	if ((pdpte & PAGE_PRESENT) == 0)
+		return (uint64_t)-1;
+	if (pdpte & PAGE_LARGE)
+		return (pdpte & PDPT_MASK & PAGE_ADDRESS_MASK) + (virt & ~PDPT_MASK);
+
+	uint64_t pde = ((uint64_t*)VIRT_DIRECT(pdpte & PAGE_MASK))[PD_INDEX(virt)];
+	if ((pde & PAGE_PRESENT) == 0)
+		return (uint64_t)-1;
+	if (pde & PAGE_LARGE)
+		return (pde & PD_MASK & PAGE_ADDRESS_MASK) + (virt & ~PD_MASK);
+
+	uint64_t pte = ((uint64_t*)VIRT_DIRECT(pde & PAGE_MASK))[PAGE_INDEX(virt)];
+	if ((pte & PAGE_PRESENT) == 0)
+		return (uint64_t)-1;
+
+	return (pte & PAGE_MASK & PAGE_ADDRESS_MASK) + (virt & ~PAGE_MASK);
+}
+
+// change the memory type of an existing mapping, e.g. a part of the direct map
+// ram mapped elsewhere with another type should have its direct map alias changed to match,
+// since the cpu doesn't define what happens when the types of two mappings disagree
+// any cpu may hold the old type in its tlb, and lines cached under it, so every cpu flushes both
+void paging_set_cache(uint64_t virt, uint64_t size, uint64_t cache) {
+	paging_update(virt, size, false, cache, false);
+	smp_flush_all(true);
+}
+
+// the pat entries selected by PAGE_CACHE_*
+enum pat_type {
+	pat_uc = 0,
+	pat_wc = 1,
+	pat_wt = 4,
+	pat_wp = 5,
+	pat_wb = 6,
+	pat_uc_minus = 7,
+};
+
+#define PAT_ENTRY(index, type) ((uint64_t)(type) << ((index) * 8))
+
+// program the pat on the current cpu, which every cpu needs to do with the same value
+// the low half keeps its power-on values and nothing maps with the pat bit yet, so no mapping
+// changes type here and the usual cache and tlb flushes around the write are unnecessary
+void paging_init_pat(void) {
+	uint64_t pat =
+		PAT_ENTRY(0, pat_wb) | PAT_ENTRY(1, pat_wt) | PAT_ENTRY(2, pat_uc_minus) |
+		PAT_ENTRY(3, pat_uc) | PAT_ENTRY(4, pat_wc) | PAT_ENTRY(5, pat_wp) |
+		PAT_ENTRY(6, pat_uc_minus) | PAT_ENTRY(7, pat_uc);
+	wrmsr(ia32_pat, pat & 0xffffffff, pat >> 32);
+}
+
+void paging_init(void *map_address, size_t map_size, size_t desc_size) {
+	// there's no memory map to allocate page tables from yet, so this relies on the efi memory map
+	// fitting in the part of the vmap region that startup.S provides tables for
+	struct efi_memory_descriptor *memory_map = vmap_phys((uint64_t)map_address, map_size, 0);
+	assert(memory_map != NULL);
+
+	// the memory map may grow into free memory as it's filled in, so keep it off the kernel image
+	// and the efi memory map first
+	extern char kernel_begin[], kernel_end[];
+	memory_reserve(PHYS_KERNEL(kernel_begin), kernel_end - kernel_begin);
+	uint64_t map_phys = (uint64_t)map_address & PAGE_MASK;
+	memory_reserve(map_phys, round_up((uint64_t)map_address + map_size, PAGE_SIZE) - map_phys);
 
 	// transfer efi memory map to our memory map
 	void *map = memory_map;
@@ -256,8 +485,7 @@ void paging_init(void *map_address, size_t map_size, size_t desc_size) {
 			// TODO: remap efi runtime memory and call SetVirtualAddressMap
 		}
 
-		memory_add(mem->physical, size);
-
+		// reserve before adding, so it's never free in between
 		if (
 			mem->type != efi_conventional &&
 			mem->type != efi_loader_code &&
@@ -266,11 +494,11 @@ void paging_init(void *map_address, size_t map_size, size_t desc_size) {
 			mem->type != efi_boot_data
 		)
 			memory_reserve(mem->physical, size);
+
+		memory_add(mem->physical, size);
 	}
 
-	// reserve kernel image
-	extern char kernel_begin[], kernel_end[];
-	memory_reserve(PHYS_KERNEL(kernel_begin), kernel_end - kernel_begin);
+	vunmap(memory_map);
 
 	// direct mapping of ram
 	uint64_t i = 0, start_frame, end_frame;
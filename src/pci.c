@@ -1,7 +1,9 @@
 #include "pci.h"
 #include "cpu.h"
+#include "vmap.h"
 #include <paging.h>
 #include <kprintf.h>
+#include <assert.h>
 #include <stdint.h>
 
 struct pci_function {
@@ -32,12 +34,16 @@ struct pci_function {
 
 // TODO: actually support non-zero groups
 static size_t segments = 0;
-static uint64_t segment_groups[1];
+static struct segment_group {
+	uint64_t ecam_address;
+	uint8_t bus_start;
+	uint8_t bus_end;
+} segment_groups[1];
 
 static volatile void *ecam;
 
 void pci_add_segment(uint16_t segment, uint64_t ecam_address, uint8_t bus_start, uint8_t bus_end) {
-	segment_groups[segments] = ecam_address;
+	segment_groups[segments] = (struct segment_group){ ecam_address, bus_start, bus_end };
 	segments++;
 
 	kprintf("pci: [segment %d] %#018lx buses %d-%d\n", segment, ecam_address, bus_start, bus_end);
@@ -90,16 +96,14 @@ static void enumerate_bus(uint8_t bus_id) {
 }
 
 void pci_enumerate(void) {
-	uint64_t ecam_address = segment_groups[0];
-
-	// TODO: factor out temporary mappings
-	extern uint64_t kernel_pml4[], pd_map[];
-	for (int i = 0; i < 8; i += 2) {
-		pd_map[1 + i / 2] =
-			ecam_address | PAGE_PRESENT | PAGE_WRITE | PAGE_CACHE_UC | PAGE_LARGE | PAGE_GLOBAL;
-	}
-	write_cr3(PHYS_KERNEL(kernel_pml4));
-	ecam = (volatile void*)0xffffffffc0200000;
+	struct segment_group *group = &segment_groups[0];
+
+	// each bus has 1M of configuration space, and ecam_address is where bus 0's would be
+	uint64_t bus_offset = (uint64_t)group->bus_start << 20;
+	uint64_t ecam_size = (uint64_t)(group->bus_end - group->bus_start + 1) << 20;
+	char *buses = ioremap(group->ecam_address + bus_offset, ecam_size);
+	assert(buses != NULL);
+	ecam = buses - bus_offset;
 
 	struct pci_function *root = function_address(0, 0, 0);
 	if ((root->header_type & 0x80) == 0) {
@@ -1,11 +1,16 @@
 #include "smp.h"
 #include "spinlock.h"
+#include "interrupt.h"
 #include "apic.h"
 #include "tsc.h"
 #include "memory.h"
+#include "page.h"
+#include "numa.h"
+#include "cpu.h"
 #include <paging.h>
 #include <kprintf.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 extern char trampoline_begin[], trampoline_end[];
@@ -27,9 +32,179 @@ void *percpu_data[256];
 
 SMP_PERCPU uint32_t smp_id;
 
+// set while a cpu is halted in smp_idle, or about to be
+static SMP_PERCPU bool cpu_idle;
+
+// work handed to a cpu by smp_run, taken by its idle loop
+static SMP_PERCPU void (*cpu_work)(void *arg);
+static SMP_PERCPU void *cpu_work_arg;
+
 static struct spinlock print_lock;
 static volatile bool ap_initialized = true;
+
+// run the work handed to this cpu, returning false if there was none
+static bool run_work(void) {
+	void (**work)(void*) = SMP_PERCPU_PTR(cpu_work);
+	void (*fn)(void*) = atomic_load_explicit(work, memory_order_acquire);
+	if (fn == NULL)
+		return false;
+
+	fn(SMP_PERCPU_READ(cpu_work_arg));
+	atomic_store_explicit(work, NULL, memory_order_release);
+	return true;
+}
+
+// the interrupt only brings the cpu out of hlt, so smp_idle looks for work again
+extern void isr_smp_wakeup(void);
+void smp_wakeup(struct registers *registers) {
+	apic_write(apic_eoi, 0);
+}
+
+// wake an idle cpu on node, if there is one, to pick up background work like refilling its zero pool
+// busy cpus find the work themselves before they halt
+void smp_wake_node(uint32_t node) {
+	// order the caller's stores that announce the work before the reads of cpu_idle- smp_idle
+	// does the opposite, so either it sees the work or this sees it idle
+	atomic_thread_fence(memory_order_seq_cst);
+
+	uint32_t self = SMP_PERCPU_READ(smp_id);
+	for (uint32_t cpu = 0; cpu < lapic_count; cpu++) {
+		if (cpu == self || node_by_cpu[cpu] != node)
+			continue;
+		if (!atomic_load_explicit(&SMP_PERCPU_SYM(cpu, cpu_idle), memory_order_relaxed))
+			continue;
+
+		apic_icr_write(lapic_by_cpu[cpu], apic_icr_fixed | interrupt_wakeup);
+		apic_icr_wait_idle(1);
+		return;
+	}
+}
+
+// do background work until there is none, then halt until an interrupt
+// poll is extra work for this cpu alone, and may be NULL
+noreturn void smp_idle(bool (*poll)(void)) {
+	bool *idle = SMP_PERCPU_PTR(cpu_idle);
+
+	// work runs with interrupts enabled, so other cpus' ipis get through
+	__asm__ volatile ("sti");
+	while (true) {
+		if (run_work() || page_zero_idle() || (poll != NULL && poll()))
+			continue;
+
+		// look for work once more after announcing the idle flag, pairing with smp_wake_node
+		// interrupts stay off until hlt, so a wakeup in between stays pending- sti takes effect
+		// only after the next instruction
+		__asm__ volatile ("cli");
+		atomic_store_explicit(idle, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (page_zero_idle())
+			__asm__ volatile ("sti");
+		else
+			__asm__ volatile ("sti; hlt");
+		atomic_store_explicit(idle, false, memory_order_relaxed);
+	}
+}
+
+// cpus that take part in tlb shootdowns, once they have an idt and an enabled local apic
+static volatile bool cpu_online[256];
+static uint32_t cpu_online_count;
+
+// what the current shootdown asks of each cpu- a flush_size of 0 flushes the whole tlb
+static struct spinlock flush_lock;
+static volatile bool flush_caches;
+static volatile uint64_t flush_start;
+static volatile uint64_t flush_size;
+static uint32_t flush_pending;
+
+static void flush_local(void) {
+	if (flush_caches)
+		__asm__ volatile ("wbinvd" ::: "memory");
+	if (flush_size == 0)
+		paging_flush_all();
+	else
+		paging_flush_range(flush_start, flush_size);
+}
+
+extern void isr_smp_flush(void);
+void smp_flush(struct registers *registers) {
+	flush_local();
+
+	atomic_fetch_sub_explicit(&flush_pending, 1, memory_order_release);
+	apic_write(apic_eoi, 0);
+}
+
+// run a shootdown on every online cpu and wait for all of them
+// another cpu may be waiting in here for this one, so interrupts must be enabled
+static void flush_cpus(uint64_t start, uint64_t size, bool caches) {
+	struct spinlock_node node;
+	spin_lock(&flush_lock, &node);
+
+	flush_caches = caches;
+	flush_start = start;
+	flush_size = size;
+
+	// until an ap is online, the bsp may not even have its per-cpu data yet
+	if (atomic_load_explicit(&cpu_online_count, memory_order_acquire) > 1) {
+		for (uint32_t cpu = 0; cpu < lapic_count; cpu++) {
+			if (!cpu_online[cpu] || cpu == SMP_PERCPU_READ(smp_id))
+				continue;
+
+			atomic_fetch_add_explicit(&flush_pending, 1, memory_order_relaxed);
+			apic_icr_write(lapic_by_cpu[cpu], apic_icr_fixed | interrupt_flush);
+			apic_icr_wait_idle(1);
+		}
+	}
+
+	flush_local();
+
+	while (atomic_load_explicit(&flush_pending, memory_order_acquire) != 0)
+		__asm__ volatile ("pause");
+
+	spin_unlock(&flush_lock, &node);
+}
+
+// flush every cpu's tlb, global pages included, and with caches, every cpu's caches too
+void smp_flush_all(bool caches) {
+	flush_cpus(0, 0, caches);
+}
+
+// flush the pages of [virt, virt + size) from every cpu's tlb
+void smp_flush_range(uint64_t virt, uint64_t size) {
+	if (size != 0)
+		flush_cpus(virt, size, false);
+}
+
+uint32_t smp_cpu_count(void) {
+	return atomic_load_explicit(&cpu_online_count, memory_order_acquire);
+}
+
+// have another online cpu run fn(arg) from its idle loop, once it has finished what it was handed
+// before- only one cpu may hand work to a given cpu at a time
+// returns false if cpu isn't online, or is the calling cpu
+bool smp_run(uint32_t cpu, void (*fn)(void *arg), void *arg) {
+	if (cpu >= lapic_count || !cpu_online[cpu] || cpu == SMP_PERCPU_READ(smp_id))
+		return false;
+
+	void (**work)(void*) = &SMP_PERCPU_SYM(cpu, cpu_work);
+	while (atomic_load_explicit(work, memory_order_acquire) != NULL)
+		__asm__ volatile ("pause");
+
+	SMP_PERCPU_SYM(cpu, cpu_work_arg) = arg;
+	atomic_store_explicit(work, fn, memory_order_release);
+
+	// the cpu may be halted- if it isn't, the wakeup only sends it around its idle loop once more
+	apic_icr_write(lapic_by_cpu[cpu], apic_icr_fixed | interrupt_wakeup);
+	apic_icr_wait_idle(1);
+	return true;
+}
+
+static uint64_t trampoline_phys;
 void smp_start(void) {
+	interrupt_init_ap();
+	apic_init_ap();
+	paging_init_pat();
+	cpu_online[SMP_PERCPU_READ(smp_id)] = true;
+	atomic_fetch_add_explicit(&cpu_online_count, 1, memory_order_release);
 	ap_initialized = true;
 
 	struct spinlock_node node;
@@ -37,35 +212,53 @@ void smp_start(void) {
 	kprintf("cpu %d started\n", SMP_PERCPU_READ(smp_id));
 	spin_unlock(&print_lock, &node);
 
-	while (true) __asm__ ("hlt");
+	page_init_deferred();
+
+	smp_idle(NULL);
 }
 
 void smp_init(void) {
 	// TODO: memory_find from 0 with a better error code?
+	// reserve whole pages, so smp_finish can give them all back
 	uint64_t trampoline_size = trampoline_end - trampoline_begin;
-	uint64_t trampoline = memory_find(PAGE_SIZE, 0x100000, trampoline_size, PAGE_SIZE);
-	memory_reserve(trampoline, trampoline_size);
+	uint64_t trampoline_pages = round_up(trampoline_size, PAGE_SIZE);
+	uint64_t trampoline = memory_find(PAGE_SIZE, 0x100000, trampoline_pages, PAGE_SIZE);
+	memory_reserve(trampoline, trampoline_pages);
 	memcpy((void*)trampoline, trampoline_begin, trampoline_size);
+	trampoline_phys = trampoline;
 
 	// allocate percpu data now that we have a number from acpi
-	uint64_t percpu_size = percpu_end - percpu_begin + PAGE_SIZE;
+	// keep the stride off a multiple of the cache colors, so each cpu starts on a different color
+	uint64_t percpu_size = round_up(percpu_end - percpu_begin + PAGE_SIZE, PAGE_SIZE);
+	uint64_t colors = page_color_count();
+	if (colors > 1 && (percpu_size >> PAGE_SHIFT) % colors == 0)
+		percpu_size += PAGE_SIZE;
 	void *percpu = memory_alloc(0x100000, memory_end(), lapic_count * percpu_size, PAGE_SIZE);
 
 	volatile uint32_t *ap_started = &TRAMPOLINE_SYM(trampoline, smp_ap_started);
 	startup_code = (uintptr_t)smp_start;
 
+	interrupt_set(interrupt_wakeup, isr_smp_wakeup);
+	interrupt_set(interrupt_flush, isr_smp_flush);
+
 	uint32_t bsp_id = apic_read(apic_id);
 	for (unsigned i = 0; i < lapic_count; i++) {
 		uint32_t apic_id = lapic_by_cpu[i];
-		if (apic_id == bsp_id) {
-			continue;
-		}
 
 		percpu_data[i] = (char*)percpu + i * percpu_size;
 		memcpy(percpu_data[i], percpu_begin, percpu_size);
 
 		SMP_PERCPU_SYM(i, smp_id) = i;
 
+		// the bsp came up with %gs = 0, so point it at its own copy
+		if (apic_id == bsp_id) {
+			uint64_t gs = (uintptr_t)percpu_data[i];
+			wrmsr(ia32_gs_base, gs & 0xffffffff, gs >> 32);
+			cpu_online[i] = true;
+			atomic_fetch_add_explicit(&cpu_online_count, 1, memory_order_release);
+			continue;
+		}
+
 		// wait for the last AP to finish using the trampoline
 		while (!ap_initialized) {
 			continue;
@@ -105,3 +298,13 @@ void smp_init(void) {
 			kprintf("apic: [%d] ap didn't set flag\n", i);
 	}
 }
+
+// wait for the last ap to leave the trampoline, then give it back to the page allocator
+// called before the identity mapping goes away, since the trampoline runs on it
+void smp_finish(void) {
+	while (!ap_initialized) {
+		continue;
+	}
+
+	page_free_range(trampoline_phys, round_up(trampoline_end - trampoline_begin, PAGE_SIZE));
+}
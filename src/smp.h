@@ -1,4 +1,6 @@
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdnoreturn.h>
 
 #define SMP_PERCPU __attribute__((section(".percpu")))
 
@@ -12,9 +14,22 @@
 	__asm__ volatile ("mov %1, %%gs:%0" : "=m"(sym) : "ir"(val))
 
 #define SMP_PERCPU_SYM(cpu, sym) \
-	*(__typeof__(sym)*)((char*)percpu_data[cpu] + (uintptr_t)&(sym))
+	(*(__typeof__(sym)*)((char*)percpu_data[cpu] + (uintptr_t)&(sym)))
+
+// pointer to the current cpu's copy of a per-cpu variable
+#define SMP_PERCPU_PTR(sym) (&SMP_PERCPU_SYM(SMP_PERCPU_READ(smp_id), sym))
 
 void smp_init(void);
+void smp_finish(void);
+
+void smp_wake_node(uint32_t node);
+uint32_t smp_cpu_count(void);
+bool smp_run(uint32_t cpu, void (*fn)(void *arg), void *arg);
+void smp_flush_all(bool caches);
+void smp_flush_range(uint64_t virt, uint64_t size);
+noreturn void smp_idle(bool (*poll)(void));
 
 extern uint8_t lapic_by_cpu[256];
 extern void *percpu_data[256];
+
+extern SMP_PERCPU uint32_t smp_id;
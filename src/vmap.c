@@ -0,0 +1,291 @@
+#include "vmap.h"
+#include "spinlock.h"
+#include "list.h"
+#include "page.h"
+#include "smp.h"
+#include <cache.h>
+#include <paging.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// a range of kernel virtual addresses handed out in areas
+struct vm_region {
+	struct spinlock lock;
+
+	// busy areas in ascending order
+	struct list areas;
+
+	uint64_t start;
+	uint64_t size;
+};
+
+struct vm_area {
+	struct list list;
+	uint64_t start;
+	uint64_t size;
+
+	// on lazy_areas once freed, while its addresses wait for a tlb flush
+	struct list lazy;
+};
+
+// the last 1G of the address space, under the last entry of kernel_pml4
+// startup.S provides the page tables for its first 2M, so small mappings work before any allocator
+static struct vm_region vmap_region = {
+	.areas = LIST_INIT(vmap_region.areas),
+	.start = 0xffffffffc0000000,
+	.size = PDPT_SIZE,
+};
+
+// virtually contiguous memory for vmalloc, backed by whatever frames page_alloc hands out
+static struct vm_region vmalloc_region = {
+	.areas = LIST_INIT(vmalloc_region.areas),
+	.start = 0xffffc90000000000,
+	.size = PML4_SIZE,
+};
+
+// unmapped pages left between vmalloc areas to catch overruns
+#define VMALLOC_GUARD PAGE_SIZE
+
+// freed areas keep their addresses until this much has piled up, then share one tlb flush
+#define VMALLOC_LAZY_MAX (32UL << 20)
+
+static struct spinlock lazy_lock;
+static struct list lazy_areas = LIST_INIT(lazy_areas);
+static uint64_t lazy_size;
+
+// area descriptors come from here until the slab allocator is up, and are never freed back to it
+#define VM_AREAS_EARLY 16
+
+static struct vm_area early_areas[VM_AREAS_EARLY];
+static uint32_t early_area_count;
+
+static struct spinlock spare_lock;
+static struct list spare_areas = LIST_INIT(spare_areas);
+
+static struct vm_area *area_new(void) {
+	struct spinlock_node node;
+	spin_lock(&spare_lock, &node);
+
+	struct vm_area *area = NULL;
+	if (!list_empty(&spare_areas)) {
+		area = containerof(spare_areas.next, struct vm_area, list);
+		list_del(&area->list);
+	} else if (early_area_count < VM_AREAS_EARLY) {
+		area = &early_areas[early_area_count++];
+	}
+
+	spin_unlock(&spare_lock, &node);
+
+	if (area == NULL)
+		area = kmalloc(sizeof(struct vm_area));
+	return area;
+}
+
+static void area_delete(struct vm_area *area) {
+	struct spinlock_node node;
+	spin_lock(&spare_lock, &node);
+	list_add_head(&area->list, &spare_areas);
+	spin_unlock(&spare_lock, &node);
+}
+
+// first fit for an area of size bytes whose start is skew bytes past a multiple of align
+// returns false if the region has no room
+// works in offsets into the region, since its end may be the top of the address space
+static bool region_insert(
+	struct vm_region *region, struct vm_area *area, uint64_t size, uint64_t align, uint64_t skew
+) {
+	struct spinlock_node node;
+	spin_lock(&region->lock, &node);
+
+	uint64_t offset = skew;
+	uint64_t end = region->size;
+	struct list *next;
+	for (next = region->areas.next; next != &region->areas; next = next->next) {
+		struct vm_area *busy = containerof(next, struct vm_area, list);
+		end = busy->start - region->start;
+		if (offset <= end && end - offset >= size)
+			break;
+
+		offset = round_up(end + busy->size + align - skew, align) - align + skew;
+		end = region->size;
+	}
+
+	bool fits = offset <= end && end - offset >= size;
+	if (fits) {
+		area->start = region->start + offset;
+		area->size = size;
+		list_insert(&area->list, next->prev, next);
+	}
+
+	spin_unlock(&region->lock, &node);
+	return fits;
+}
+
+static struct vm_area *region_find(struct vm_region *region, uint64_t address) {
+	struct spinlock_node node;
+	spin_lock(&region->lock, &node);
+
+	struct vm_area *area = NULL;
+	for (struct list *l = region->areas.next; l != &region->areas; l = l->next) {
+		struct vm_area *busy = containerof(l, struct vm_area, list);
+		if (address >= busy->start && address - busy->start < busy->size) {
+			area = busy;
+			break;
+		}
+	}
+
+	spin_unlock(&region->lock, &node);
+	return area;
+}
+
+static void region_remove(struct vm_region *region, struct vm_area *area) {
+	struct spinlock_node node;
+	spin_lock(&region->lock, &node);
+	list_del(&area->list);
+	spin_unlock(&region->lock, &node);
+}
+
+// ranges of 2M or more keep the same offset into a 2M page as phys, so paging_map can use large pages
+void *vmap_phys(uint64_t phys, uint64_t size, uint64_t flags) {
+	uint64_t offset = phys & ~PAGE_MASK;
+	uint64_t phys_start = phys & PAGE_MASK;
+	uint64_t map_size = round_up(offset + size, PAGE_SIZE);
+
+	uint64_t align = map_size >= PD_SIZE ? PD_SIZE : PAGE_SIZE;
+
+	struct vm_area *area = area_new();
+	if (area == NULL)
+		return NULL;
+
+	if (!region_insert(&vmap_region, area, map_size, align, phys_start & (align - 1))) {
+		area_delete(area);
+		return NULL;
+	}
+
+	paging_map(area->start, phys_start, map_size, flags | PAGE_PRESENT | PAGE_GLOBAL);
+	return (void*)(area->start + offset);
+}
+
+// map device registers uncached
+void *ioremap(uint64_t phys, uint64_t size) {
+	return vmap_phys(phys, size, PAGE_WRITE | PAGE_CACHE_UC);
+}
+
+// map memory that is only streamed to, e.g. a framebuffer or a prefetchable bar, write-combining
+void *ioremap_wc(uint64_t phys, uint64_t size) {
+	return vmap_phys(phys, size, PAGE_WRITE | PAGE_CACHE_WC);
+}
+
+void vunmap(void *virt) {
+	struct vm_area *area = region_find(&vmap_region, (uint64_t)virt);
+	assert(area != NULL);
+
+	// unmap before giving the addresses back, so nobody maps over them in between
+	// device mappings like the local apic's are used from every cpu, so every tlb drops them
+	paging_unmap_lazy(area->start, area->size);
+	smp_flush_range(area->start, area->size);
+	region_remove(&vmap_region, area);
+	area_delete(area);
+}
+
+// flush every cpu's tlb once for all the lazily freed areas, then give their addresses back
+static void vmalloc_purge(void) {
+	struct list areas = LIST_INIT(areas);
+
+	struct spinlock_node node;
+	spin_lock(&lazy_lock, &node);
+	if (!list_empty(&lazy_areas)) {
+		// splice the whole list over to areas
+		list_insert(&areas, lazy_areas.prev, lazy_areas.next);
+		list_init(&lazy_areas);
+	}
+	lazy_size = 0;
+	spin_unlock(&lazy_lock, &node);
+
+	if (list_empty(&areas))
+		return;
+
+	smp_flush_all(false);
+
+	while (!list_empty(&areas)) {
+		struct vm_area *area = containerof(areas.next, struct vm_area, lazy);
+		list_del(&area->lazy);
+
+		region_remove(&vmalloc_region, area);
+		area_delete(area);
+	}
+}
+
+// unmap the pages of [start, start + size) and free the frames behind them
+static void vmalloc_unmap(uint64_t start, uint64_t size, bool lazy) {
+	for (uint64_t address = start; address < start + size; address += PAGE_SIZE) {
+		uint64_t phys = paging_translate(address);
+		if (lazy)
+			paging_unmap_lazy(address, PAGE_SIZE);
+		else
+			paging_unmap(address, PAGE_SIZE);
+		page_free(page_from_address(VIRT_DIRECT(phys)));
+	}
+}
+
+// allocate virtually contiguous memory a page at a time, followed by a guard page
+void *vmalloc(uint64_t size) {
+	if (size == 0)
+		return NULL;
+
+	uint64_t map_size = round_up(size, PAGE_SIZE);
+
+	struct vm_area *area = area_new();
+	if (area == NULL)
+		return NULL;
+
+	// running out of addresses may only mean they're waiting on a flush
+	uint64_t area_size = map_size + VMALLOC_GUARD;
+	if (!region_insert(&vmalloc_region, area, area_size, PAGE_SIZE, 0)) {
+		vmalloc_purge();
+		if (!region_insert(&vmalloc_region, area, area_size, PAGE_SIZE, 0)) {
+			area_delete(area);
+			return NULL;
+		}
+	}
+
+	for (uint64_t offset = 0; offset < map_size; offset += PAGE_SIZE) {
+		struct page *page = page_alloc();
+		if (page == NULL) {
+			// nothing but this cpu has seen the area yet, so unmap with a local flush right away
+			vmalloc_unmap(area->start, offset, false);
+
+			region_remove(&vmalloc_region, area);
+			area_delete(area);
+			return NULL;
+		}
+
+		uint64_t phys = PHYS_DIRECT(page_address(page));
+		paging_map(area->start + offset, phys, PAGE_SIZE, PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL);
+	}
+
+	return (void*)area->start;
+}
+
+// frames are freed right away- only the addresses wait for a flush before they can be reused,
+// since nothing touches a freed area through its stale tlb entries in the meantime
+void vfree(void *address) {
+	if (address == NULL)
+		return;
+
+	struct vm_area *area = region_find(&vmalloc_region, (uint64_t)address);
+	assert(area != NULL && area->start == (uint64_t)address);
+
+	vmalloc_unmap(area->start, area->size - VMALLOC_GUARD, true);
+
+	struct spinlock_node node;
+	spin_lock(&lazy_lock, &node);
+	list_add_tail(&area->lazy, &lazy_areas);
+	lazy_size += area->size;
+	bool purge = lazy_size >= VMALLOC_LAZY_MAX;
+	spin_unlock(&lazy_lock, &node);
+
+	if (purge)
+		vmalloc_purge();
+}
@@ -0,0 +1,13 @@
+#include <stdint.h>
+
+// map a physical range into kernel virtual memory, e.g. device registers
+// flags are page table flags like PAGE_WRITE and a PAGE_CACHE_* type- PAGE_PRESENT and PAGE_GLOBAL
+// are implied
+void *vmap_phys(uint64_t phys, uint64_t size, uint64_t flags);
+void *ioremap(uint64_t phys, uint64_t size);
+void *ioremap_wc(uint64_t phys, uint64_t size);
+void vunmap(void *virt);
+
+// virtually contiguous memory, not physically contiguous
+void *vmalloc(uint64_t size);
+void vfree(void *address);